@@ -0,0 +1,586 @@
+/**
+ * \file batch.c
+ * \brief Insertion en lot : un manifeste de triplets (cover, message, sortie) traité par un
+ *        ensemble de threads.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "error.h"
+#include "lsb.h"
+
+/* Jobs of one worker: indexes [head, tail) of batch->jobs. The owner takes
+ * from the head, thieves from the tail */
+typedef struct WorkQueue_s
+{
+	pthread_mutex_t lock;
+	int head;
+	int tail;
+} WorkQueue;
+
+typedef struct Pool_s
+{
+	Batch *batch;
+	batch_embed_fn embed;
+	WorkQueue *queues;
+	int nbThreads;
+} Pool;
+
+typedef struct Worker_s
+{
+	Pool *pool;
+	int id;
+	pthread_t thread;
+} Worker;
+
+
+/* Memory each worker keeps from one image to the next (see jpeg_mem_arena):
+ * enough for the libjpeg objects of a 24 Mpixel 4:2:0 cover */
+#define WORKER_ARENA_BYTES (128L << 20)
+
+/* Default number of images waiting between two pipeline stages */
+#define PIPELINE_DEPTH 4
+
+/* Yields of a stage waiting on a ring before it goes to sleep */
+#define RING_SPINS 64
+
+/* Bounded single producer / single consumer queue: the producer only
+ * writes tail, the consumer only writes head, each on its own cache line.
+ * A stage that cannot go on sleeps on cond; lock and cond are only used
+ * then, the other stage wakes it when sleepers is not zero */
+typedef struct Ring_s
+{
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+	_Alignas(64) void **slots;
+	unsigned int mask;
+	atomic_int sleepers;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} Ring;
+
+/* An image travelling through the pipeline */
+typedef struct Item_s
+{
+	BatchJob *job;
+	JPEGimg *img;
+	char *msg;
+	long size;
+	int status;
+} Item;
+
+typedef struct Pipeline_s
+{
+	Batch *batch;
+	batch_embed_fn embed;
+	Ring toEmbed;
+	Ring toWrite;
+} Pipeline;
+
+
+/* Whole content of a file, NUL terminated; NULL on error */
+static char *load_file (const char *path, long *size)
+{
+	FILE *file;
+	char *buf;
+
+	if ((file = fopen (path, "rb")) == NULL)
+	{
+		print_err ("load_file()", (char*) path, ERR_FOPEN);
+		return NULL;
+	}
+	if (fseek (file, 0, SEEK_END) != 0 || (*size = ftell (file)) < 0)
+	{
+		print_err ("load_file()", (char*) path, ERR_FREAD);
+		fclose (file);
+		return NULL;
+	}
+	rewind (file);
+
+	if ((buf = (char*) malloc (*size + 1)) == NULL)
+	{
+		print_err ("load_file()", (char*) path, ERR_MEM);
+		fclose (file);
+		return NULL;
+	}
+	if (fread (buf, 1, *size, file) != (size_t) *size)
+	{
+		print_err ("load_file()", (char*) path, ERR_FREAD);
+		free (buf);
+		fclose (file);
+		return NULL;
+	}
+	buf[*size] = '\0';
+
+	fclose (file);
+	return buf;
+}
+
+
+/* Field separators of a manifest line */
+#define BLANKS " \t\r"
+
+
+Batch *batch_load (char *path)
+{
+	Batch *batch;
+	BatchJob *job;
+	char *p, *line, *next, *save;
+	long size;
+	int nbLines = 1;
+
+	if (!path)
+	{
+		print_err ("batch_load()", "path", ERR_ARG);
+		return NULL;
+	}
+	if ((batch = (Batch*) calloc (1, sizeof(Batch))) == NULL)
+	{
+		print_err ("batch_load()", "batch", ERR_MEM);
+		return NULL;
+	}
+	if ((batch->text = load_file (path, &size)) == NULL)
+	{
+		batch_free (batch);
+		return NULL;
+	}
+
+	for (p = batch->text; *p; p++)
+		nbLines += (*p == '\n');
+	if ((batch->jobs = (BatchJob*) calloc (nbLines, sizeof(BatchJob))) == NULL)
+	{
+		print_err ("batch_load()", "batch->jobs", ERR_MEM);
+		batch_free (batch);
+		return NULL;
+	}
+
+	// One job per line: cover payload output
+	for (line = batch->text; line; line = next)
+	{
+		if ((next = strchr (line, '\n')) != NULL)
+			*next++ = '\0';
+
+		job = batch->jobs + batch->nbJobs;
+		if ((job->cover = strtok_r (line, BLANKS, &save)) == NULL || job->cover[0] == '#')
+			continue;
+		job->payload = strtok_r (NULL, BLANKS, &save);
+		job->output = strtok_r (NULL, BLANKS, &save);
+		if (!job->payload || !job->output || strtok_r (NULL, BLANKS, &save))
+		{
+			print_err ("batch_load()", job->cover, ERR_ARG);
+			batch_free (batch);
+			return NULL;
+		}
+		job->status = ERR_TREAT;
+		batch->nbJobs++;
+	}
+
+	return batch;
+}
+
+
+void batch_free (Batch *batch)
+{
+	if (!batch)
+		return;
+	free (batch->jobs);
+	free (batch->text);
+	free (batch);
+}
+
+
+/* Read, embed, write into img, the JPEGimg of the worker: the decompression
+ * object and the coefficient storage are reused from one cover to the next
+ * (see jpeg_read_into), nothing is shared with other workers. A cover with
+ * a cache file is mapped from it instead (jpeg_read_cached), without decoding */
+static int run_job (BatchJob *job, batch_embed_fn embed, JPEGimg *img)
+{
+	JPEGimg *cached;
+	char *msg;
+	long size;
+	int ret;
+
+	if ((msg = load_file (job->payload, &size)) == NULL)
+		return ERR_FOPEN;
+
+	/* A cover that cannot be decoded fails this job only: jpeg_read_into
+	 * catches the libjpeg error and keeps img for the next cover */
+	if ((cached = jpeg_read_cached (job->cover)) == NULL
+	    && (jpeg_is_cache (job->cover) || (ret = jpeg_read_into (img, job->cover)) != EXIT_SUCCESS))
+	{
+		free (msg);
+		return jpeg_is_cache (job->cover) ? ERR_FREAD : ret;
+	}
+	if (cached)
+	{
+		cached->restartThreads = 1;
+		img = cached;
+	}
+
+	if ((ret = embed ((unsigned char*) msg, (int) size, img)) == EXIT_SUCCESS)
+		ret = jpeg_write_from_coeffs (job->output, img);
+
+	if (cached)
+		free_jpeg_img (cached);
+	free (msg);
+	return ret;
+}
+
+
+/* Next job of worker id: its own queue first, else steal the second half of
+ * the first non empty queue. -1 once every queue is empty (jobs never create
+ * jobs, so there is nothing left to wait for) */
+static int next_job (Pool *pool, int id)
+{
+	WorkQueue *own = pool->queues + id, *victim;
+	int job = -1, k, n = 0;
+
+	pthread_mutex_lock (&own->lock);
+	if (own->head < own->tail)
+		job = own->head++;
+	pthread_mutex_unlock (&own->lock);
+	if (job >= 0)
+		return job;
+
+	for (k = 1; k < pool->nbThreads && job < 0; k++)
+	{
+		victim = pool->queues + (id + k) % pool->nbThreads;
+		pthread_mutex_lock (&victim->lock);
+		if ((n = victim->tail - victim->head) > 0)
+		{
+			n = (n + 1) / 2;
+			victim->tail -= n;
+			job = victim->tail;
+		}
+		pthread_mutex_unlock (&victim->lock);
+	}
+
+	// The first stolen job is run now, the others go to the own queue (never
+	// locked together with the victim's, so thieves cannot deadlock)
+	if (job >= 0 && n > 1)
+	{
+		pthread_mutex_lock (&own->lock);
+		own->head = job + 1;
+		own->tail = job + n;
+		pthread_mutex_unlock (&own->lock);
+	}
+	return job;
+}
+
+
+static void *worker_main (void *arg)
+{
+	Worker *w = (Worker*) arg;
+	Batch *batch = w->pool->batch;
+	JPEGimg *img;
+	int job;
+
+	// The libjpeg memory of an image is reused by the next one on this thread
+	jpeg_mem_arena (WORKER_ARENA_BYTES);
+	img = init_jpeg_img ();
+
+	// One worker per core already: restart intervals are coded in the worker's thread
+	if (img)
+		img->restartThreads = 1;
+	while ((job = next_job (w->pool, w->id)) >= 0)
+		batch->jobs[job].status = img ? run_job (batch->jobs + job, w->pool->embed, img) : ERR_MEM;
+	if (img)
+		free_jpeg_img (img);
+	jpeg_mem_arena (0);
+
+	return NULL;
+}
+
+
+int batch_run (Batch *batch, int nbThreads, batch_embed_fn embed)
+{
+	Pool pool;
+	Worker *workers;
+	int i, started, failed = 0;
+
+	if (!batch || !embed || nbThreads < 0)
+	{
+		print_err ("batch_run()", "batch", ERR_ARG);
+		return ERR_ARG;
+	}
+	if (nbThreads == 0 && (nbThreads = (int) sysconf (_SC_NPROCESSORS_ONLN)) < 1)
+		nbThreads = 1;
+	if (nbThreads > batch->nbJobs)
+		nbThreads = batch->nbJobs > 0 ? batch->nbJobs : 1;
+
+	pool.batch = batch;
+	pool.embed = embed;
+	pool.nbThreads = nbThreads;
+	pool.queues = (WorkQueue*) malloc (nbThreads * sizeof(WorkQueue));
+	workers = (Worker*) malloc (nbThreads * sizeof(Worker));
+	if (!pool.queues || !workers)
+	{
+		print_err ("batch_run()", "pool.queues", ERR_MEM);
+		free (pool.queues);
+		free (workers);
+		return ERR_MEM;
+	}
+
+	// Kernel selection is done once, before the workers share it
+	lsb_simd (-1);
+
+	// Contiguous slices of the manifest, so neighbouring covers stay together
+	for (i = 0; i < nbThreads; i++)
+	{
+		pthread_mutex_init (&pool.queues[i].lock, NULL);
+		pool.queues[i].head = (int) ((long long) batch->nbJobs * i / nbThreads);
+		pool.queues[i].tail = (int) ((long long) batch->nbJobs * (i + 1) / nbThreads);
+		workers[i].pool = &pool;
+		workers[i].id = i;
+	}
+
+	// The calling thread is worker 0; others that cannot be started leave
+	// their slice to be stolen
+	for (started = 1; started < nbThreads; started++)
+		if (pthread_create (&workers[started].thread, NULL, worker_main, workers + started) != 0)
+			break;
+	worker_main (workers);
+	for (i = 1; i < started; i++)
+		pthread_join (workers[i].thread, NULL);
+
+	for (i = 0; i < nbThreads; i++)
+		pthread_mutex_destroy (&pool.queues[i].lock);
+	free (pool.queues);
+	free (workers);
+
+	for (i = 0; i < batch->nbJobs; i++)
+		failed += (batch->jobs[i].status != EXIT_SUCCESS);
+	return failed;
+}
+
+
+static int ring_init (Ring *ring, int depth)
+{
+	unsigned int size = 1;
+
+	while (size < (unsigned int) depth)
+		size <<= 1;
+	atomic_init (&ring->head, 0);
+	atomic_init (&ring->tail, 0);
+	atomic_init (&ring->sleepers, 0);
+	ring->mask = size - 1;
+	if ((ring->slots = (void**) malloc (size * sizeof(void*))) == NULL)
+		return ERR_MEM;
+	pthread_mutex_init (&ring->lock, NULL);
+	pthread_cond_init (&ring->cond, NULL);
+	return EXIT_SUCCESS;
+}
+
+
+/* Release a ring (nothing to do if ring_init failed on it) */
+static void ring_free (Ring *ring)
+{
+	if (!ring->slots)
+		return;
+	pthread_mutex_destroy (&ring->lock);
+	pthread_cond_destroy (&ring->cond);
+	free (ring->slots);
+	ring->slots = NULL;
+}
+
+
+/* True once the producer (push) can write at tail pos, or the consumer can
+ * read at head pos */
+static int ring_ready (Ring *ring, int push, unsigned int pos)
+{
+	if (push)
+		return pos - atomic_load (&ring->head) <= ring->mask;
+	return atomic_load (&ring->tail) != pos;
+}
+
+
+/* Wait until ring_ready: a few yields first, since the other stage is often
+ * about to move, then sleep so that an idle stage leaves its core to the
+ * others. sleepers is raised before ready is checked again, and the other
+ * stage reads it after moving its index (both sequentially consistent), so
+ * a wake-up cannot be missed */
+static void ring_wait (Ring *ring, int push, unsigned int pos)
+{
+	int spins;
+
+	for (spins = 0; spins < RING_SPINS; spins++)
+	{
+		if (ring_ready (ring, push, pos))
+			return;
+		sched_yield ();
+	}
+
+	pthread_mutex_lock (&ring->lock);
+	atomic_fetch_add (&ring->sleepers, 1);
+	while (!ring_ready (ring, push, pos))
+		pthread_cond_wait (&ring->cond, &ring->lock);
+	atomic_fetch_sub (&ring->sleepers, 1);
+	pthread_mutex_unlock (&ring->lock);
+}
+
+
+/* Wake the other stage if it sleeps in ring_wait */
+static void ring_wake (Ring *ring)
+{
+	if (atomic_load (&ring->sleepers) == 0)
+		return;
+	pthread_mutex_lock (&ring->lock);
+	pthread_cond_broadcast (&ring->cond);
+	pthread_mutex_unlock (&ring->lock);
+}
+
+
+static void ring_push (Ring *ring, void *item)
+{
+	unsigned int tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+
+	ring_wait (ring, 1, tail);
+	ring->slots[tail & ring->mask] = item;
+	atomic_store (&ring->tail, tail + 1);
+	ring_wake (ring);
+}
+
+
+static void *ring_pop (Ring *ring)
+{
+	unsigned int head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+	void *item;
+
+	ring_wait (ring, 0, head);
+	item = ring->slots[head & ring->mask];
+	atomic_store (&ring->head, head + 1);
+	ring_wake (ring);
+	return item;
+}
+
+
+/* Stage 1: file reading and entropy decoding. A NULL item ends the stream */
+static void *stage_read (void *arg)
+{
+	Pipeline *pipe = (Pipeline*) arg;
+	Item *item;
+	int i;
+
+	for (i = 0; i < pipe->batch->nbJobs; i++)
+	{
+		if ((item = (Item*) calloc (1, sizeof(Item))) == NULL)
+		{
+			print_err ("batch_pipeline()", "item", ERR_MEM);
+			pipe->batch->jobs[i].status = ERR_MEM;
+			continue;
+		}
+		item->job = pipe->batch->jobs + i;
+
+		/* A cover that cannot be decoded (the libjpeg error is caught by
+		 * jpeg_read) goes down the stages as a failed item */
+		if ((item->msg = load_file (item->job->payload, &item->size)) == NULL)
+			item->status = ERR_FOPEN;
+		else if ((item->img = jpeg_read_cover (item->job->cover)) == NULL)
+			item->status = ERR_FREAD;
+		else
+			item->status = EXIT_SUCCESS;
+		ring_push (&pipe->toEmbed, item);
+	}
+	ring_push (&pipe->toEmbed, NULL);
+	return NULL;
+}
+
+
+/* Stage 2: embedding in the coefficients */
+static void *stage_embed (void *arg)
+{
+	Pipeline *pipe = (Pipeline*) arg;
+	Item *item;
+
+	while ((item = (Item*) ring_pop (&pipe->toEmbed)) != NULL)
+	{
+		if (item->status == EXIT_SUCCESS)
+			item->status = pipe->embed ((unsigned char*) item->msg, (int) item->size, item->img);
+		ring_push (&pipe->toWrite, item);
+	}
+	ring_push (&pipe->toWrite, NULL);
+	return NULL;
+}
+
+
+/* Stage 3: entropy encoding and file writing */
+static void stage_write (Pipeline *pipe)
+{
+	Item *item;
+
+	while ((item = (Item*) ring_pop (&pipe->toWrite)) != NULL)
+	{
+		if (item->status == EXIT_SUCCESS)
+			item->status = jpeg_write_from_coeffs (item->job->output, item->img);
+		item->job->status = item->status;
+		if (item->img)
+			free_jpeg_img (item->img);
+		free (item->msg);
+		free (item);
+	}
+}
+
+
+int batch_pipeline (Batch *batch, int depth, batch_embed_fn embed)
+{
+	Pipeline pipe;
+	pthread_t reader, embedder;
+	int i, failed = 0;
+
+	if (!batch || !embed || depth < 0)
+	{
+		print_err ("batch_pipeline()", "batch", ERR_ARG);
+		return ERR_ARG;
+	}
+	if (depth == 0)
+		depth = PIPELINE_DEPTH;
+
+	pipe.batch = batch;
+	pipe.embed = embed;
+	pipe.toWrite.slots = NULL;
+	if (ring_init (&pipe.toEmbed, depth) != EXIT_SUCCESS || ring_init (&pipe.toWrite, depth) != EXIT_SUCCESS)
+	{
+		print_err ("batch_pipeline()", "pipe.slots", ERR_MEM);
+		ring_free (&pipe.toEmbed);
+		ring_free (&pipe.toWrite);
+		return ERR_MEM;
+	}
+
+	// Kernel selection is done once, before the stages share it
+	lsb_simd (-1);
+
+	// Without threads, the images are processed one after the other
+	if (pthread_create (&embedder, NULL, stage_embed, &pipe) != 0)
+	{
+		ring_free (&pipe.toEmbed);
+		ring_free (&pipe.toWrite);
+		return batch_run (batch, 1, embed);
+	}
+	if (pthread_create (&reader, NULL, stage_read, &pipe) != 0)
+	{
+		ring_push (&pipe.toEmbed, NULL);
+		stage_write (&pipe);
+		pthread_join (embedder, NULL);
+		ring_free (&pipe.toEmbed);
+		ring_free (&pipe.toWrite);
+		return batch_run (batch, 1, embed);
+	}
+
+	stage_write (&pipe);
+	pthread_join (embedder, NULL);
+	pthread_join (reader, NULL);
+
+	ring_free (&pipe.toEmbed);
+	ring_free (&pipe.toWrite);
+
+	for (i = 0; i < batch->nbJobs; i++)
+		failed += (batch->jobs[i].status != EXIT_SUCCESS);
+	return failed;
+}
@@ -0,0 +1,101 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+/**
+ * \file batch.h
+ * \brief Insertion en lot : un manifeste de triplets (cover, message, sortie) traité par un
+ *        ensemble de threads.
+ *
+ * Le manifeste contient une tâche par ligne : chemin de l'image cover, chemin du fichier
+ * message, chemin de l'image à écrire, séparés par des blancs. Les lignes vides et celles
+ * commençant par '#' sont ignorées. La cover peut être un fichier cache (.jcc, voir
+ * jpeg_write_cache) ; une cover JPEG dont le cache existe est lue depuis celui-ci, sans
+ * décodage de Huffman (jpeg_read_cached).
+ *
+ * batch_run répartit les images entre des threads : chaque thread a sa propre file de tâches
+ * et, une fois celle-ci vide, vole la moitié de la file d'un autre thread. Aucun objet de la
+ * libjpeg n'est partagé entre threads ; chaque thread lit toutes ses covers dans la même structure
+ * JPEGimg (jpeg_read_into) et réutilise pour l'image suivante la mémoire libérée par la libjpeg
+ * (jpeg_mem_arena), sans repasser par malloc pour des covers de même taille.
+ *
+ * batch_pipeline découpe au contraire le traitement en trois étages (lecture et décodage,
+ * insertion, encodage et écriture), chacun sur son thread, reliés par des files bornées sans
+ * verrou : les entrées/sorties, le codage de Huffman et l'insertion de plusieurs images se
+ * recouvrent. Un étage qui attend son voisin s'endort après quelques essais et libère son cœur.
+ *
+ * \defgroup Batch
+ * \brief Traitement d'un lot d'images
+ * \{
+ */
+
+#include "jpeg_manip.h"
+
+/**
+ * \defgroup structures_batch
+ * \brief Structures de batch
+ * \{
+ */
+
+/// @brief Fonction d'insertion appliquée à chaque image (basic_insert, advanced_insert...)
+typedef int (*batch_embed_fn) (unsigned char *msg, int size, JPEGimg *img);
+
+
+/// @brief Une tâche du manifeste
+typedef struct BatchJob_s
+{
+	/// chemin de l'image cover
+	char * cover;
+	/// chemin du fichier contenant le message
+	char * payload;
+	/// chemin de l'image stéganographiée à écrire
+	char * output;
+	/// EXIT_SUCCESS une fois la tâche réussie, code d'erreur négatif sinon
+	int status;
+} BatchJob;
+
+
+/// @brief Lot de tâches lu depuis un manifeste
+typedef struct Batch_s
+{
+	/// tâches, dans l'ordre du manifeste
+	BatchJob * jobs;
+	/// nombre de tâches
+	int nbJobs;
+	/// contenu du manifeste, dans lequel pointent les chemins des tâches
+	char * text;
+} Batch;
+
+/// \}
+
+/// @brief		Lit un manifeste
+/// @param[in] path	chemin du manifeste
+/// @return			le lot de tâches alloué, NULL en cas d'erreur
+Batch * batch_load (char *path);
+
+
+/// @brief		Libère un lot créé par batch_load
+/// @param[in] batch	lot à libérer (peut être NULL)
+void batch_free (Batch *batch);
+
+
+/// @brief		Exécute toutes les tâches du lot : lecture de la cover et du message, insertion
+///				par embed, écriture de la sortie. Le statut de chaque tâche est rempli.
+/// @param[in,out] batch	lot à traiter
+/// @param[in] nbThreads	nombre de threads (0 : un par cœur)
+/// @param[in] embed		fonction d'insertion
+/// @return					le nombre de tâches en échec, une valeur négative en cas d'erreur
+int batch_run (Batch *batch, int nbThreads, batch_embed_fn embed);
+
+
+/// @brief		Exécute toutes les tâches du lot en pipeline : un thread lit et décode les covers,
+///				un autre insère les messages, le thread appelant encode et écrit les sorties.
+///				Le statut de chaque tâche est rempli.
+/// @param[in,out] batch	lot à traiter
+/// @param[in] depth		nombre maximal d'images en attente entre deux étages (0 : valeur par défaut)
+/// @param[in] embed		fonction d'insertion
+/// @return					le nombre de tâches en échec, une valeur négative en cas d'erreur
+int batch_pipeline (Batch *batch, int depth, batch_embed_fn embed);
+
+/// \}
+
+#endif /* BATCH_H_ */
@@ -924,6 +924,7 @@ jinit_arith_encoder (j_compress_ptr cinfo)
 				SIZEOF(arith_entropy_encoder));
   cinfo->entropy = (struct jpeg_entropy_encoder *) entropy;
   entropy->pub.start_pass = start_pass;
+  entropy->pub.encode_intervals = NULL; /* no parallel encoding */
   entropy->pub.finish_pass = finish_pass;
 
   /* Mark tables unallocated */
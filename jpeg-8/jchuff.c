@@ -24,6 +24,12 @@
 #include "jinclude.h"
 #include "jpeglib.h"
 
+#ifndef HAVE_STDLIB_H		/* <stdlib.h> should declare malloc(),free() */
+extern void * malloc JPP((size_t size));
+extern void * realloc JPP((void *ptr, size_t size));
+extern void free JPP((void *ptr));
+#endif
+
 
 /* The legal range of a DCT coefficient is
  *  -1024 .. +1023  for 8-bit data;
@@ -52,8 +58,14 @@ typedef struct {
  * but must not be updated permanently until we complete the MCU.
  */
 
+/* The bit-accumulation buffer holds at least 64 bits: sequential mode
+ * keeps up to 31 pending bits in it, right-justified (see EMIT_BITS_S);
+ * progressive mode keeps up to 7, left-justified in the right 24 bits.
+ */
+typedef unsigned long long bit_buf_type;
+
 typedef struct {
-  INT32 put_buffer;		/* current bit-accumulation buffer */
+  bit_buf_type put_buffer;	/* current bit-accumulation buffer */
   int put_bits;			/* # of bits now in it */
   int last_dc_val[MAX_COMPS_IN_SCAN]; /* last DC coef for each component */
 } savable_state;
@@ -296,50 +308,84 @@ dump_buffer_e (huff_entropy_ptr entropy)
 
 /* Outputting bits to the file */
 
-/* Only the right 24 bits of put_buffer are used; the valid bits are
- * left-justified in this part.  At most 16 bits can be passed to emit_bits
- * in one call, and we never retain more than 7 bits in put_buffer
- * between calls, so 24 bits are sufficient.
+/* Sequential mode.
+ * Bits are shifted into put_buffer from the right, and fewer than 32 are
+ * left pending between calls, so one call can take up to 32 bits: a
+ * Huffman code together with the magnitude bits that follow it.  As soon
+ * as 32 bits are pending they are written out as 4 bytes.  0xFF bytes
+ * need a stuffed zero after them; when there is none among the 4 (one
+ * register test for all of them) and the output buffer has room, the
+ * bytes are stored directly.
  */
 
-LOCAL(boolean) 
-emit_bits_s (working_state * state, unsigned int code, int size)
-/* Emit some bits; return TRUE if successful, FALSE if must suspend */
+/* Nonzero if some byte of the 32-bit value x is 0xFF */
+#define HAS_FF_BYTE(x)  ((~(x) - 0x01010101UL) & (x) & 0x80808080UL)
+
+/* Number of bits in the magnitude of x > 0 */
+#ifdef __GNUC__
+#define NBITS_NONZERO(x)  (32 - __builtin_clz((unsigned int) (x)))
+#else
+LOCAL(int)
+nbits_nonzero (register unsigned int x)
 {
-  /* This routine is heavily used, so it's worth coding tightly. */
-  register INT32 put_buffer = (INT32) code;
-  register int put_bits = state->cur.put_bits;
+  register int nbits = 1;	/* there must be at least one 1 bit */
 
-  /* if size is 0, caller used an invalid Huffman table entry */
-  if (size == 0)
-    ERREXIT(state->cinfo, JERR_HUFF_MISSING_CODE);
+  while ((x >>= 1))
+    nbits++;
+  return nbits;
+}
+#define NBITS_NONZERO(x)  nbits_nonzero((unsigned int) (x))
+#endif
 
-  put_buffer &= (((INT32) 1)<<size) - 1; /* mask off any extra bits in code */
-  
-  put_bits += size;		/* new number of bits in buffer */
-  
-  put_buffer <<= 24 - put_bits; /* align incoming bits */
 
-  put_buffer |= state->cur.put_buffer; /* and merge with old buffer contents */
-  
-  while (put_bits >= 8) {
-    int c = (int) ((put_buffer >> 16) & 0xFF);
-    
+LOCAL(boolean)
+dump_bits_s (working_state * state, bit_buf_type put_buffer, int put_bits)
+/* Write out the 32 oldest of the put_bits >= 32 pending bits */
+{
+  register unsigned long word;
+  int shift, c;
+
+  word = (unsigned long) (put_buffer >> (put_bits - 32)) & 0xFFFFFFFFUL;
+
+  if (! HAS_FF_BYTE(word) && state->free_in_buffer > 4) {
+    state->next_output_byte[0] = (JOCTET) (word >> 24);
+    state->next_output_byte[1] = (JOCTET) (word >> 16);
+    state->next_output_byte[2] = (JOCTET) (word >> 8);
+    state->next_output_byte[3] = (JOCTET) word;
+    state->next_output_byte += 4;
+    state->free_in_buffer -= 4;
+    return TRUE;
+  }
+
+  for (shift = 24; shift >= 0; shift -= 8) {
+    c = (int) ((word >> shift) & 0xFF);
     emit_byte_s(state, c, return FALSE);
     if (c == 0xFF) {		/* need to stuff a zero byte? */
       emit_byte_s(state, 0, return FALSE);
     }
-    put_buffer <<= 8;
-    put_bits -= 8;
   }
-
-  state->cur.put_buffer = put_buffer; /* update state variables */
-  state->cur.put_bits = put_bits;
-
   return TRUE;
 }
 
 
+/* Emit size bits of code (masked, size <= 32) through the local variables
+ * put_buffer and put_bits; take action if must suspend.
+ */
+#define EMIT_BITS_S(state,code,size,action) \
+	{ put_buffer = (put_buffer << (size)) | (bit_buf_type) (code); \
+	  if ((put_bits += (size)) >= 32) { \
+	    if (! dump_bits_s(state, put_buffer, put_bits)) \
+	      { action; } \
+	    put_bits -= 32; } }
+
+
+/* Progressive mode.
+ * Only the right 24 bits of put_buffer are used; the valid bits are
+ * left-justified in this part.  At most 16 bits can be passed to emit_bits
+ * in one call, and we never retain more than 7 bits in put_buffer
+ * between calls, so 24 bits are sufficient.
+ */
+
 LOCAL(void)
 emit_bits_e (huff_entropy_ptr entropy, unsigned int code, int size)
 /* Emit some bits, unless we are in gather mode */
@@ -383,9 +429,25 @@ emit_bits_e (huff_entropy_ptr entropy, unsigned int code, int size)
 LOCAL(boolean)
 flush_bits_s (working_state * state)
 {
-  if (! emit_bits_s(state, 0x7F, 7)) /* fill any partial byte with ones */
-    return FALSE;
-  state->cur.put_buffer = 0;	     /* and reset bit-buffer to empty */
+  register bit_buf_type put_buffer = state->cur.put_buffer;
+  register int put_bits = state->cur.put_bits;
+  int c;
+
+  /* fill any partial byte with ones */
+  put_buffer = (put_buffer << 7) | 0x7F;
+  put_bits += 7;
+
+  /* and write out all the whole bytes */
+  while (put_bits >= 8) {
+    put_bits -= 8;
+    c = (int) ((put_buffer >> put_bits) & 0xFF);
+    emit_byte_s(state, c, return FALSE);
+    if (c == 0xFF) {		/* need to stuff a zero byte? */
+      emit_byte_s(state, 0, return FALSE);
+    }
+  }
+
+  state->cur.put_buffer = 0;	/* and reset bit-buffer to empty */
   state->cur.put_bits = 0;
   return TRUE;
 }
@@ -912,44 +974,43 @@ LOCAL(boolean)
 encode_one_block (working_state * state, JCOEFPTR block, int last_dc_val,
 		  c_derived_tbl *dctbl, c_derived_tbl *actbl)
 {
-  register int temp, temp2;
+  register int temp, temp2, sign;
   register int nbits;
   register int k, r, i;
+  register bit_buf_type put_buffer = state->cur.put_buffer;
+  register int put_bits = state->cur.put_bits;
   int Se = state->cinfo->lim_Se;
   const int * natural_order = state->cinfo->natural_order;
 
-  /* Encode the DC coefficient difference per section F.1.2.1 */
+  /* The magnitude bits of a coefficient are sent together with its Huffman
+   * code: the value, if positive, or the complement of its magnitude, if
+   * negative.  sign is all ones for a negative value, so temp ^ sign - sign
+   * is its magnitude and temp + sign the bits to send.
+   * This code assumes we are on a two's complement machine.
+   */
 
-  temp = temp2 = block[0] - last_dc_val;
+  /* Encode the DC coefficient difference per section F.1.2.1 */
 
-  if (temp < 0) {
-    temp = -temp;		/* temp is abs value of input */
-    /* For a negative input, want temp2 = bitwise complement of abs(input) */
-    /* This code assumes we are on a two's complement machine */
-    temp2--;
-  }
+  temp = block[0] - last_dc_val;
+  sign = -(temp < 0);
+  temp2 = temp + sign;
+  temp = (temp ^ sign) - sign;	/* temp is abs value of input */
 
   /* Find the number of bits needed for the magnitude of the coefficient */
-  nbits = 0;
-  while (temp) {
-    nbits++;
-    temp >>= 1;
-  }
+  nbits = temp ? NBITS_NONZERO(temp) : 0;
   /* Check for out-of-range coefficient values.
    * Since we're encoding a difference, the range limit is twice as much.
    */
   if (nbits > MAX_COEF_BITS+1)
     ERREXIT(state->cinfo, JERR_BAD_DCT_COEF);
 
-  /* Emit the Huffman-coded symbol for the number of bits */
-  if (! emit_bits_s(state, dctbl->ehufco[nbits], dctbl->ehufsi[nbits]))
-    return FALSE;
-
-  /* Emit that number of bits of the value, if positive, */
-  /* or the complement of its magnitude, if negative. */
-  if (nbits)			/* emit_bits rejects calls with size 0 */
-    if (! emit_bits_s(state, (unsigned int) temp2, nbits))
-      return FALSE;
+  /* Emit the Huffman-coded symbol for the number of bits, then the bits */
+  if (dctbl->ehufsi[nbits] == 0)
+    ERREXIT(state->cinfo, JERR_HUFF_MISSING_CODE);
+  EMIT_BITS_S(state,
+	      ((unsigned int) dctbl->ehufco[nbits] << nbits) |
+	      ((unsigned int) temp2 & ((((unsigned int) 1) << nbits) - 1)),
+	      dctbl->ehufsi[nbits] + nbits, return FALSE);
 
   /* Encode the AC coefficients per section F.1.2.2 */
 
@@ -961,44 +1022,45 @@ encode_one_block (working_state * state, JCOEFPTR block, int last_dc_val,
     } else {
       /* if run length > 15, must emit special run-length-16 codes (0xF0) */
       while (r > 15) {
-	if (! emit_bits_s(state, actbl->ehufco[0xF0], actbl->ehufsi[0xF0]))
-	  return FALSE;
+	if (actbl->ehufsi[0xF0] == 0)
+	  ERREXIT(state->cinfo, JERR_HUFF_MISSING_CODE);
+	EMIT_BITS_S(state, actbl->ehufco[0xF0], actbl->ehufsi[0xF0],
+		    return FALSE);
 	r -= 16;
       }
 
-      temp2 = temp;
-      if (temp < 0) {
-	temp = -temp;		/* temp is abs value of input */
-	/* This code assumes we are on a two's complement machine */
-	temp2--;
-      }
+      sign = -(temp < 0);
+      temp2 = temp + sign;
+      temp = (temp ^ sign) - sign; /* temp is abs value of input */
 
       /* Find the number of bits needed for the magnitude of the coefficient */
-      nbits = 1;		/* there must be at least one 1 bit */
-      while ((temp >>= 1))
-	nbits++;
+      nbits = NBITS_NONZERO(temp);
       /* Check for out-of-range coefficient values */
       if (nbits > MAX_COEF_BITS)
 	ERREXIT(state->cinfo, JERR_BAD_DCT_COEF);
 
-      /* Emit Huffman symbol for run length / number of bits */
+      /* Emit Huffman symbol for run length / number of bits, then the bits */
       i = (r << 4) + nbits;
-      if (! emit_bits_s(state, actbl->ehufco[i], actbl->ehufsi[i]))
-	return FALSE;
-
-      /* Emit that number of bits of the value, if positive, */
-      /* or the complement of its magnitude, if negative. */
-      if (! emit_bits_s(state, (unsigned int) temp2, nbits))
-	return FALSE;
+      if (actbl->ehufsi[i] == 0)
+	ERREXIT(state->cinfo, JERR_HUFF_MISSING_CODE);
+      EMIT_BITS_S(state,
+		  ((unsigned int) actbl->ehufco[i] << nbits) |
+		  ((unsigned int) temp2 & ((((unsigned int) 1) << nbits) - 1)),
+		  actbl->ehufsi[i] + nbits, return FALSE);
 
       r = 0;
     }
   }
 
   /* If the last coef(s) were zero, emit an end-of-block code */
-  if (r > 0)
-    if (! emit_bits_s(state, actbl->ehufco[0], actbl->ehufsi[0]))
-      return FALSE;
+  if (r > 0) {
+    if (actbl->ehufsi[0] == 0)
+      ERREXIT(state->cinfo, JERR_HUFF_MISSING_CODE);
+    EMIT_BITS_S(state, actbl->ehufco[0], actbl->ehufsi[0], return FALSE);
+  }
+
+  state->cur.put_buffer = put_buffer; /* update state variables */
+  state->cur.put_bits = put_bits;
 
   return TRUE;
 }
@@ -1100,6 +1162,128 @@ finish_pass_huff (j_compress_ptr cinfo)
 }
 
 
+/*
+ * Encoding of a run of restart intervals into a private buffer.
+ *
+ * The bit buffer and the DC predictions are reset at a restart marker, so a
+ * run of whole intervals can be encoded from private copies of the
+ * compression and entropy objects, into a memory destination of its own.
+ * The transcoding coefficient controller uses this to encode the intervals
+ * of a scan on several threads, then writes the buffers out in order; the
+ * result is the same as encoding the scan in one go.
+ */
+
+typedef struct {
+  struct jpeg_destination_mgr pub; /* public fields */
+
+  JOCTET * buffer;		/* start of buffer (malloc'd) */
+  size_t bufsize;		/* current size of buffer */
+} interval_destination_mgr;
+
+typedef interval_destination_mgr * interval_dest_ptr;
+
+#define MIN_INTERVAL_BUF_SIZE  4096	/* smallest preallocation */
+
+
+METHODDEF(void)
+init_interval_destination (j_compress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+
+METHODDEF(boolean)
+empty_interval_buffer (j_compress_ptr cinfo)
+/* Double the buffer; cannot suspend */
+{
+  interval_dest_ptr dest = (interval_dest_ptr) cinfo->dest;
+  JOCTET * nextbuffer;
+
+  nextbuffer = (JOCTET *) realloc(dest->buffer, dest->bufsize * 2);
+  if (nextbuffer == NULL)
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 12);
+
+  dest->pub.next_output_byte = nextbuffer + dest->bufsize;
+  dest->pub.free_in_buffer = dest->bufsize;
+
+  dest->buffer = nextbuffer;
+  dest->bufsize *= 2;
+
+  return TRUE;
+}
+
+
+METHODDEF(void)
+term_interval_destination (j_compress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+
+METHODDEF(void)
+encode_intervals (j_compress_ptr cinfo,
+		  JDIMENSION start_MCU, JDIMENSION num_MCUs,
+		  locate_c_MCU_method_ptr locate_MCU, JBLOCKROW workspace,
+		  JOCTET ** outbuffer, size_t * outsize)
+{
+  struct jpeg_compress_struct local;
+  struct jpeg_error_mgr err;
+  interval_destination_mgr dest;
+  huff_entropy_encoder entropy;
+  JBLOCKROW MCU_data[C_MAX_BLOCKS_IN_MCU];
+  JDIMENSION MCU_num;
+  int ci;
+
+  /* Private copies of everything encode_mcu_huff may modify */
+  local = *cinfo;
+  err = *cinfo->err;
+  local.err = &err;
+  entropy = *((huff_entropy_ptr) cinfo->entropy);
+  entropy.cinfo = &local;
+  local.entropy = (struct jpeg_entropy_encoder *) &entropy;
+
+  /* Guess about 16 bytes per block; the buffer grows as needed */
+  dest.bufsize = (size_t) num_MCUs * (size_t) cinfo->blocks_in_MCU * 16;
+  if (dest.bufsize < MIN_INTERVAL_BUF_SIZE)
+    dest.bufsize = MIN_INTERVAL_BUF_SIZE;
+  dest.buffer = (JOCTET *) malloc(dest.bufsize);
+  if (dest.buffer == NULL)
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 12);
+  dest.pub.next_output_byte = dest.buffer;
+  dest.pub.free_in_buffer = dest.bufsize;
+  dest.pub.init_destination = init_interval_destination;
+  dest.pub.empty_output_buffer = empty_interval_buffer;
+  dest.pub.term_destination = term_interval_destination;
+  local.dest = &dest.pub;
+
+  /* Same state as at the start of the scan, or just before the restart
+   * marker that opens interval start_MCU / restart_interval.
+   */
+  entropy.saved.put_buffer = 0;
+  entropy.saved.put_bits = 0;
+  for (ci = 0; ci < cinfo->comps_in_scan; ci++)
+    entropy.saved.last_dc_val[ci] = 0;
+  if (start_MCU == 0) {
+    entropy.restarts_to_go = cinfo->restart_interval;
+    entropy.next_restart_num = 0;
+  } else {
+    entropy.restarts_to_go = 0;
+    entropy.next_restart_num =
+      (int) ((start_MCU / cinfo->restart_interval - 1) & 7);
+  }
+
+  /* Cannot suspend: the destination grows as needed */
+  for (MCU_num = start_MCU; MCU_num < start_MCU + num_MCUs; MCU_num++) {
+    (*locate_MCU) (&local, MCU_num, MCU_data, workspace);
+    (void) encode_mcu_huff(&local, MCU_data);
+  }
+  finish_pass_huff(&local);
+
+  *outbuffer = dest.buffer;
+  *outsize = dest.bufsize - dest.pub.free_in_buffer;
+}
+
+
 /*
  * Huffman coding optimization.
  *
@@ -1248,7 +1432,7 @@ encode_mcu_gather (j_compress_ptr cinfo, JBLOCKROW *MCU_data)
  * So the extra complexity of an optimal algorithm doesn't seem worthwhile.
  */
 
-LOCAL(void)
+GLOBAL(void)
 jpeg_gen_optimal_table (j_compress_ptr cinfo, JHUFF_TBL * htbl, long freq[])
 {
 #define MAX_CLEN 32		/* assumed maximum initial code length */
@@ -1491,6 +1675,12 @@ start_pass_huff (j_compress_ptr cinfo, boolean gather_statistics)
       entropy->pub.encode_mcu = encode_mcu_huff;
   }
 
+  /* Runs of restart intervals can be encoded apart in sequential output */
+  if (cinfo->progressive_mode || gather_statistics)
+    entropy->pub.encode_intervals = NULL;
+  else
+    entropy->pub.encode_intervals = encode_intervals;
+
   for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
     compptr = cinfo->cur_comp_info[ci];
     /* DC needs no table for refinement scan */
@@ -33,6 +33,7 @@ typedef unsigned char boolean;
 /* These are for configuring the JPEG memory manager. */
 /* #undef DEFAULT_MAX_MEM */
 /* #undef NO_MKTEMP */
+#define USE_MMAP_MEMMGR 1
 
 #endif /* JPEG_INTERNALS */
 
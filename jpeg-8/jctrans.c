@@ -15,6 +15,26 @@
 #include "jinclude.h"
 #include "jpeglib.h"
 
+#ifdef NO_PTHREADS
+#undef C_PARALLEL_RESTART_SUPPORTED
+#endif
+
+#ifdef C_PARALLEL_RESTART_SUPPORTED
+#include <pthread.h>
+#include <unistd.h>		/* for sysconf */
+
+#ifndef HAVE_STDLIB_H		/* <stdlib.h> should declare free() */
+extern void free JPP((void *ptr));
+#endif
+
+#ifndef MAX_RESTART_THREADS	/* most threads used to encode one scan */
+#define MAX_RESTART_THREADS  16
+#endif
+#ifndef RESTART_THREADS		/* threads wanted if restart_threads is 0 */
+#define RESTART_THREADS  ((int) sysconf(_SC_NPROCESSORS_ONLN))
+#endif
+#endif
+
 
 /* Forward declarations */
 LOCAL(void) transencode_master_selection
@@ -212,6 +232,15 @@ typedef struct {
 
   /* Workspace for constructing dummy blocks at right/bottom edges. */
   JBLOCKROW dummy_buffer[C_MAX_BLOCKS_IN_MCU];
+
+#ifdef C_PARALLEL_RESTART_SUPPORTED
+  /* When a scan is encoded by several threads at once, each component of
+   * the scan must be wholly in memory; these are its block rows.
+   */
+  JBLOCKARRAY scan_buffer[MAX_COMPS_IN_SCAN];
+  boolean try_parallel;		/* nothing written yet in this pass? */
+  boolean pass_done;		/* whole pass written by compress_parallel */
+#endif
 } my_coef_controller;
 
 typedef my_coef_controller * my_coef_ptr;
@@ -255,9 +284,192 @@ start_pass_coef (j_compress_ptr cinfo, J_BUF_MODE pass_mode)
 
   coef->iMCU_row_num = 0;
   start_iMCU_row(cinfo);
+#ifdef C_PARALLEL_RESTART_SUPPORTED
+  coef->try_parallel = TRUE;
+  coef->pass_done = FALSE;
+#endif
 }
 
 
+#ifdef C_PARALLEL_RESTART_SUPPORTED
+
+/*
+ * Threaded encoding of a scan with restart markers.
+ *
+ * Each run of whole restart intervals can be encoded on its own (see
+ * encode_intervals in the entropy encoder), so when the output has restart
+ * markers and the coefficient arrays are in memory, we split the intervals
+ * between threads, each encoding its share into a buffer of its own, then
+ * write the buffers to the destination in order.  The output is the same
+ * as with the ordinary MCU-row by MCU-row encoding, which is used whenever
+ * this is not possible.
+ */
+
+typedef struct {
+  j_compress_ptr cinfo;
+  JDIMENSION start_MCU;		/* first MCU of this share */
+  JDIMENSION num_MCUs;		/* MCUs in this share */
+  JOCTET * buffer;		/* encoded share (malloc'd) */
+  size_t size;			/* bytes in buffer */
+} interval_job;
+
+
+METHODDEF(void)
+locate_MCU (j_compress_ptr cinfo, JDIMENSION MCU_num, JBLOCKROW *MCU_data,
+	    JBLOCKROW workspace)
+/* Point MCU_data at the blocks of MCU number MCU_num of the scan */
+{
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+  JDIMENSION MCU_row = MCU_num / cinfo->MCUs_per_row;
+  JDIMENSION MCU_col = MCU_num % cinfo->MCUs_per_row;
+  JDIMENSION row, col;
+  int blkn, ci, xindex, yindex;
+  JBLOCKROW buffer_ptr;
+  jpeg_component_info *compptr;
+
+  /* Same blocks as in compress_output: an MCU row spans MCU_height block
+   * rows (v_samp_factor for an interleaved scan, 1 otherwise), and the
+   * blocks past the component's edges are dummies.
+   */
+  blkn = 0;
+  for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
+    compptr = cinfo->cur_comp_info[ci];
+    col = MCU_col * compptr->MCU_width;
+    for (yindex = 0; yindex < compptr->MCU_height; yindex++) {
+      row = MCU_row * compptr->MCU_height + yindex;
+      xindex = 0;
+      if (row < compptr->height_in_blocks) {
+	buffer_ptr = coef->scan_buffer[ci][row] + col;
+	for (; xindex < compptr->MCU_width &&
+	       col + xindex < compptr->width_in_blocks; xindex++)
+	  MCU_data[blkn++] = buffer_ptr++;
+      }
+      for (; xindex < compptr->MCU_width; xindex++) {
+	MCU_data[blkn] = workspace + blkn;
+	MCU_data[blkn][0][0] = MCU_data[blkn-1][0][0];
+	blkn++;
+      }
+    }
+  }
+}
+
+
+LOCAL(void *)
+encode_share (void * arg)
+/* Thread body: encode a run of consecutive restart intervals */
+{
+  interval_job * job = (interval_job *) arg;
+  JBLOCK workspace[C_MAX_BLOCKS_IN_MCU];
+
+  FMEMZERO((void FAR *) workspace, SIZEOF(workspace));
+  (*job->cinfo->entropy->encode_intervals)
+    (job->cinfo, job->start_MCU, job->num_MCUs, locate_MCU, workspace,
+     &job->buffer, &job->size);
+  return NULL;
+}
+
+
+LOCAL(void)
+write_share (j_compress_ptr cinfo, const JOCTET * buffer, size_t size)
+/* Copy an encoded share to the destination */
+{
+  struct jpeg_destination_mgr * dest = cinfo->dest;
+  size_t n;
+
+  while (size > 0) {
+    n = size < dest->free_in_buffer ? size : dest->free_in_buffer;
+    MEMCOPY(dest->next_output_byte, buffer, n);
+    dest->next_output_byte += n;
+    dest->free_in_buffer -= n;
+    buffer += n;
+    size -= n;
+    /* As everywhere else, never leave the buffer full */
+    if (dest->free_in_buffer == 0)
+      if (! (*dest->empty_output_buffer) (cinfo))
+	ERREXIT(cinfo, JERR_CANT_SUSPEND);
+  }
+}
+
+
+LOCAL(boolean)
+compress_parallel (j_compress_ptr cinfo)
+/* Encode the whole current scan, its restart intervals spread over threads.
+ * Returns FALSE, having written nothing, if this cannot be done.
+ */
+{
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+  JDIMENSION total_MCUs, num_intervals, first, last, row;
+  int ci, t, num_threads, started;
+  JBLOCKARRAY buffer;
+  jpeg_component_info *compptr;
+  pthread_t thread[MAX_RESTART_THREADS];
+  interval_job job[MAX_RESTART_THREADS];
+
+  if (cinfo->restart_interval == 0 ||
+      cinfo->entropy->encode_intervals == NULL)
+    return FALSE;
+
+  total_MCUs = cinfo->MCUs_per_row * cinfo->MCU_rows_in_scan;
+  num_intervals = (total_MCUs + cinfo->restart_interval - 1) /
+		  cinfo->restart_interval;
+  num_threads = cinfo->restart_threads > 0 ? cinfo->restart_threads :
+		RESTART_THREADS;
+  if (num_threads > MAX_RESTART_THREADS)
+    num_threads = MAX_RESTART_THREADS;
+  if ((JDIMENSION) num_threads > num_intervals)
+    num_threads = (int) num_intervals;
+  if (num_threads < 2)
+    return FALSE;
+
+  /* Check that each component of the scan is wholly in memory, with its
+   * rows in one pointer array.
+   */
+  for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
+    compptr = cinfo->cur_comp_info[ci];
+    for (row = 0; row < cinfo->total_iMCU_rows; row++) {
+      buffer = (*cinfo->mem->access_virt_barray)
+	((j_common_ptr) cinfo, coef->whole_image[compptr->component_index],
+	 row * compptr->v_samp_factor,
+	 (JDIMENSION) compptr->v_samp_factor, FALSE);
+      if (row == 0)
+	coef->scan_buffer[ci] = buffer;
+      else if (buffer != coef->scan_buffer[ci] + row * compptr->v_samp_factor)
+	return FALSE;
+    }
+  }
+
+  for (t = 0; t < num_threads; t++) {
+    first = num_intervals * t / num_threads;
+    last = num_intervals * (t + 1) / num_threads;
+    job[t].cinfo = cinfo;
+    job[t].start_MCU = first * cinfo->restart_interval;
+    job[t].num_MCUs = last * cinfo->restart_interval - job[t].start_MCU;
+    if (job[t].start_MCU + job[t].num_MCUs > total_MCUs)
+      job[t].num_MCUs = total_MCUs - job[t].start_MCU;
+  }
+  /* The calling thread takes the first share, and any share whose thread
+   * could not be created.
+   */
+  for (started = 1; started < num_threads; started++)
+    if (pthread_create(&thread[started], NULL, encode_share,
+		       (void *) &job[started]) != 0)
+      break;
+  encode_share((void *) &job[0]);
+  for (t = started; t < num_threads; t++)
+    encode_share((void *) &job[t]);
+  for (t = 1; t < started; t++)
+    pthread_join(thread[t], NULL);
+
+  for (t = 0; t < num_threads; t++) {
+    write_share(cinfo, job[t].buffer, job[t].size);
+    free(job[t].buffer);
+  }
+  return TRUE;
+}
+
+#endif /* C_PARALLEL_RESTART_SUPPORTED */
+
+
 /*
  * Process some data.
  * We process the equivalent of one fully interleaved MCU row ("iMCU" row)
@@ -282,6 +494,21 @@ compress_output (j_compress_ptr cinfo, JSAMPIMAGE input_buf)
   JBLOCKROW buffer_ptr;
   jpeg_component_info *compptr;
 
+#ifdef C_PARALLEL_RESTART_SUPPORTED
+  /* On the first call of a pass, try to encode all of it at once; the
+   * remaining calls then only count the iMCU rows.
+   */
+  if (coef->try_parallel) {
+    coef->try_parallel = FALSE;
+    coef->pass_done = compress_parallel(cinfo);
+  }
+  if (coef->pass_done) {
+    coef->iMCU_row_num++;
+    start_iMCU_row(cinfo);
+    return TRUE;
+  }
+#endif
+
   /* Align the virtual buffers for the components used in this scan. */
   for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
     compptr = cinfo->cur_comp_info[ci];
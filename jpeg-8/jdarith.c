@@ -752,6 +752,7 @@ jinit_arith_decoder (j_decompress_ptr cinfo)
 				SIZEOF(arith_entropy_decoder));
   cinfo->entropy = (struct jpeg_entropy_decoder *) entropy;
   entropy->pub.start_pass = start_pass;
+  entropy->pub.decode_interval = NULL; /* no parallel decoding */
 
   /* Mark tables unallocated */
   for (i = 0; i < NUM_ARITH_TBLS; i++) {
@@ -7,7 +7,8 @@
  * For conditions of distribution and use, see the accompanying README file.
  *
  * This file contains compression data destination routines for the case of
- * emitting JPEG data to memory or to a file (or any stdio stream).
+ * emitting JPEG data to memory or to a file (or any stdio stream), possibly
+ * through a single growable buffer.
  * While these routines are sufficient for most applications,
  * some will want to use a different destination manager.
  * IMPORTANT: we assume that fwrite() will correctly transcribe an array of
@@ -22,6 +23,7 @@
 
 #ifndef HAVE_STDLIB_H		/* <stdlib.h> should declare malloc(),free() */
 extern void * malloc JPP((size_t size));
+extern void * realloc JPP((void *ptr, size_t size));
 extern void free JPP((void *ptr));
 #endif
 
@@ -55,6 +57,25 @@ typedef struct {
 typedef my_mem_destination_mgr * my_mem_dest_ptr;
 
 
+/* Expanded data destination object for growable buffer output: the whole
+ * image is kept in one buffer, then written at once or handed over */
+
+typedef struct {
+  struct jpeg_destination_mgr pub; /* public fields */
+
+  FILE * outfile;		/* target stream, or NULL for memory output */
+  unsigned char ** outbuffer;	/* target buffer for memory output */
+  unsigned long * outsize;
+  JOCTET * buffer;		/* start of buffer (malloc'd) */
+  size_t bufsize;
+  size_t size_hint;		/* initial size of buffer */
+} my_grow_destination_mgr;
+
+typedef my_grow_destination_mgr * my_grow_dest_ptr;
+
+#define MIN_GROW_BUF_SIZE  65536L	/* smallest preallocation */
+
+
 /*
  * Initialize destination --- called by jpeg_start_compress
  * before any data is actually written.
@@ -80,6 +101,22 @@ init_mem_destination (j_compress_ptr cinfo)
   /* no work necessary here */
 }
 
+METHODDEF(void)
+init_grow_destination (j_compress_ptr cinfo)
+{
+  my_grow_dest_ptr dest = (my_grow_dest_ptr) cinfo->dest;
+
+  /* Allocate the whole expected output at once --- it is released (or
+   * handed over) by term_grow_destination */
+  dest->bufsize = dest->size_hint;
+  dest->buffer = (JOCTET *) malloc(dest->bufsize);
+  if (dest->buffer == NULL)
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+
+  dest->pub.next_output_byte = dest->buffer;
+  dest->pub.free_in_buffer = dest->bufsize;
+}
+
 
 /*
  * Empty the output buffer --- called whenever buffer fills up.
@@ -150,6 +187,32 @@ empty_mem_output_buffer (j_compress_ptr cinfo)
 }
 
 
+METHODDEF(boolean)
+empty_grow_output_buffer (j_compress_ptr cinfo)
+{
+  size_t nextsize;
+  JOCTET * nextbuffer;
+  my_grow_dest_ptr dest = (my_grow_dest_ptr) cinfo->dest;
+
+  /* The size hint was too small: double the buffer.  realloc can often
+   * extend it in place, so the data already written is rarely copied.
+   */
+  nextsize = dest->bufsize * 2;
+  nextbuffer = (JOCTET *) realloc(dest->buffer, nextsize);
+
+  if (nextbuffer == NULL)
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+
+  dest->pub.next_output_byte = nextbuffer + dest->bufsize;
+  dest->pub.free_in_buffer = nextsize - dest->bufsize;
+
+  dest->buffer = nextbuffer;
+  dest->bufsize = nextsize;
+
+  return TRUE;
+}
+
+
 /*
  * Terminate destination --- called by jpeg_finish_compress
  * after all data has been written.  Usually needs to flush buffer.
@@ -185,6 +248,33 @@ term_mem_destination (j_compress_ptr cinfo)
   *dest->outsize = dest->bufsize - dest->pub.free_in_buffer;
 }
 
+METHODDEF(void)
+term_grow_destination (j_compress_ptr cinfo)
+{
+  my_grow_dest_ptr dest = (my_grow_dest_ptr) cinfo->dest;
+  size_t datacount = dest->bufsize - dest->pub.free_in_buffer;
+
+  if (dest->outfile == NULL) {
+    /* Hand the buffer over to the caller */
+    *dest->outbuffer = dest->buffer;
+    *dest->outsize = datacount;
+  } else {
+    /* Write the whole image at once */
+    if (datacount > 0 &&
+	JFWRITE(dest->outfile, dest->buffer, datacount) != datacount)
+      ERREXIT(cinfo, JERR_FILE_WRITE);
+    fflush(dest->outfile);
+    free(dest->buffer);
+    /* Make sure we wrote the output file OK */
+    if (ferror(dest->outfile))
+      ERREXIT(cinfo, JERR_FILE_WRITE);
+  }
+  dest->buffer = NULL;
+  dest->bufsize = 0;
+  dest->pub.next_output_byte = NULL;
+  dest->pub.free_in_buffer = 0;
+}
+
 
 /*
  * Prepare for output to a stdio stream.
@@ -265,3 +355,51 @@ jpeg_mem_dest (j_compress_ptr cinfo,
   dest->pub.next_output_byte = dest->buffer = *outbuffer;
   dest->pub.free_in_buffer = dest->bufsize = *outsize;
 }
+
+
+/*
+ * Prepare for output through a single growable buffer.
+ * size_hint is the expected size of the compressed data (for instance the
+ * size of the file the coefficients were read from, plus a margin): the
+ * buffer is preallocated with that size and doubled whenever it fills up,
+ * so a good hint means one allocation and no copy.
+ * If outfile is not NULL, the whole image is written to it with a single
+ * fwrite() by jpeg_finish_compress; the caller is responsible for opening
+ * and closing the stream.  Otherwise the buffer is returned in *outbuffer
+ * and its data size in *outsize, and the caller must free() it.
+ * The buffer is allocated when compression starts and is not released by
+ * jpeg_abort or jpeg_destroy.
+ */
+
+GLOBAL(void)
+jpeg_grow_dest (j_compress_ptr cinfo, FILE * outfile,
+		unsigned char ** outbuffer, unsigned long * outsize,
+		unsigned long size_hint)
+{
+  my_grow_dest_ptr dest;
+
+  if (outfile == NULL && (outbuffer == NULL || outsize == NULL))
+    ERREXIT(cinfo, JERR_BUFFER_SIZE);	/* sanity check */
+
+  /* Same caveat as jpeg_stdio_dest about mixing destination managers */
+  if (cinfo->dest == NULL) {	/* first time for this JPEG object? */
+    cinfo->dest = (struct jpeg_destination_mgr *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+				  SIZEOF(my_grow_destination_mgr));
+  }
+
+  dest = (my_grow_dest_ptr) cinfo->dest;
+  dest->pub.init_destination = init_grow_destination;
+  dest->pub.empty_output_buffer = empty_grow_output_buffer;
+  dest->pub.term_destination = term_grow_destination;
+  dest->outfile = outfile;
+  dest->outbuffer = outbuffer;
+  dest->outsize = outsize;
+
+  dest->buffer = NULL;
+  dest->bufsize = 0;
+
+  if (size_hint < (unsigned long) MIN_GROW_BUF_SIZE)
+    size_hint = MIN_GROW_BUF_SIZE;
+  dest->size_hint = (size_t) size_hint;
+}
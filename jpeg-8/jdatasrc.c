@@ -7,7 +7,8 @@
  * For conditions of distribution and use, see the accompanying README file.
  *
  * This file contains decompression data source routines for the case of
- * reading JPEG data from memory or from a file (or any stdio stream).
+ * reading JPEG data from memory or from a file (or any stdio stream),
+ * possibly memory-mapped.
  * While these routines are sufficient for most applications,
  * some will want to use a different source manager.
  * IMPORTANT: we assume that fread() will correctly transcribe an array of
@@ -20,6 +21,12 @@
 #include "jpeglib.h"
 #include "jerror.h"
 
+#ifndef NO_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
 
 /* Expanded data source object for stdio input */
 
@@ -36,6 +43,23 @@ typedef my_source_mgr * my_src_ptr;
 #define INPUT_BUF_SIZE  4096	/* choose an efficiently fread'able size */
 
 
+#ifndef NO_MMAP
+
+/* Expanded data source object for memory-mapped file input */
+
+typedef struct {
+  struct jpeg_source_mgr pub;	/* public fields */
+
+  JOCTET * map;			/* start of the mapping, NULL once released */
+  size_t mapsize;		/* length of the mapping */
+  boolean start_of_file;	/* has the mapping been handed out yet? */
+} my_mmap_source_mgr;
+
+typedef my_mmap_source_mgr * my_mmap_src_ptr;
+
+#endif /* NO_MMAP */
+
+
 /*
  * Initialize source --- called by jpeg_read_header
  * before any data is actually read.
@@ -59,6 +83,18 @@ init_mem_source (j_decompress_ptr cinfo)
   /* no work necessary here */
 }
 
+#ifndef NO_MMAP
+
+METHODDEF(void)
+init_mmap_source (j_decompress_ptr cinfo)
+{
+  my_mmap_src_ptr src = (my_mmap_src_ptr) cinfo->src;
+
+  src->start_of_file = TRUE;
+}
+
+#endif /* NO_MMAP */
+
 
 /*
  * Fill the input buffer --- called whenever buffer is emptied.
@@ -140,6 +176,30 @@ fill_mem_input_buffer (j_decompress_ptr cinfo)
 }
 
 
+#ifndef NO_MMAP
+
+METHODDEF(boolean)
+fill_mmap_input_buffer (j_decompress_ptr cinfo)
+{
+  my_mmap_src_ptr src = (my_mmap_src_ptr) cinfo->src;
+
+  /* The first call hands the whole file to the decoder; the decoder only
+   * comes back if the data is truncated, which is handled as in the memory
+   * source manager.
+   */
+  if (src->start_of_file && src->map != NULL) {
+    src->start_of_file = FALSE;
+    src->pub.next_input_byte = src->map;
+    src->pub.bytes_in_buffer = src->mapsize;
+    return TRUE;
+  }
+
+  return fill_mem_input_buffer(cinfo);
+}
+
+#endif /* NO_MMAP */
+
+
 /*
  * Skip data --- used to skip over a potentially large amount of
  * uninteresting data (such as an APPn marker).
@@ -199,6 +259,24 @@ term_source (j_decompress_ptr cinfo)
   /* no work necessary here */
 }
 
+#ifndef NO_MMAP
+
+METHODDEF(void)
+term_mmap_source (j_decompress_ptr cinfo)
+{
+  my_mmap_src_ptr src = (my_mmap_src_ptr) cinfo->src;
+
+  /* Nothing may be read from the mapping past this point */
+  if (src->map != NULL) {
+    munmap((void *) src->map, src->mapsize);
+    src->map = NULL;
+    src->pub.next_input_byte = NULL;
+    src->pub.bytes_in_buffer = 0;
+  }
+}
+
+#endif /* NO_MMAP */
+
 
 /*
  * Prepare for input from a stdio stream.
@@ -215,10 +293,14 @@ jpeg_stdio_src (j_decompress_ptr cinfo, FILE * infile)
    * of JPEG images can be read from the same file by calling jpeg_stdio_src
    * only before the first one.  (If we discarded the buffer at the end of
    * one image, we'd likely lose the start of the next one.)
-   * This makes it unsafe to use this manager and a different source
-   * manager serially with the same JPEG object.  Caveat programmer.
+   * A source object left by another manager (jpeg_mem_src, jpeg_mmap_src)
+   * is replaced by a new one (the old one stays in the permanent pool), so
+   * that an object may be read from a file after a memory buffer, and
+   * jpeg_mmap_src may fall back to this manager on an object it already
+   * used.
    */
-  if (cinfo->src == NULL) {	/* first time for this JPEG object? */
+  if (cinfo->src == NULL ||	/* first time for this JPEG object? */
+      cinfo->src->init_source != init_source) {
     cinfo->src = (struct jpeg_source_mgr *)
       (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
 				  SIZEOF(my_source_mgr));
@@ -273,3 +355,59 @@ jpeg_mem_src (j_decompress_ptr cinfo,
   src->bytes_in_buffer = (size_t) insize;
   src->next_input_byte = (JOCTET *) inbuffer;
 }
+
+
+/*
+ * Prepare for input from a stdio stream, by mapping the whole file in
+ * memory instead of reading it INPUT_BUF_SIZE bytes at a time.
+ * The caller must have already opened the stream; it may close it as soon
+ * as this function returns.  The mapping is released by term_source, which
+ * applications that never call jpeg_finish_decompress (transcoders reading
+ * the coefficients) must call themselves once the data has been read.
+ * If the stream cannot be mapped (pipe, empty file, NO_MMAP), this falls
+ * back to jpeg_stdio_src, so the stream must then stay open.
+ * The source object is permanent, so a series of files can be read with
+ * the same JPEG object by calling this function before each one; a source
+ * object of another manager (including the stdio fallback) is replaced.
+ */
+
+GLOBAL(void)
+jpeg_mmap_src (j_decompress_ptr cinfo, FILE * infile)
+{
+#ifndef NO_MMAP
+  my_mmap_src_ptr src;
+  struct stat st;
+  void * map;
+
+  if (fstat(fileno(infile), &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size <= 0 || (off_t) (size_t) st.st_size != st.st_size ||
+      (map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE,
+		  fileno(infile), 0)) == MAP_FAILED) {
+    jpeg_stdio_src(cinfo, infile);
+    return;
+  }
+#ifdef MADV_SEQUENTIAL
+  (void) madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+#endif
+
+  if (cinfo->src == NULL ||	/* first time for this JPEG object? */
+      cinfo->src->init_source != init_mmap_source) {
+    cinfo->src = (struct jpeg_source_mgr *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+				  SIZEOF(my_mmap_source_mgr));
+  }
+
+  src = (my_mmap_src_ptr) cinfo->src;
+  src->pub.init_source = init_mmap_source;
+  src->pub.fill_input_buffer = fill_mmap_input_buffer;
+  src->pub.skip_input_data = skip_input_data;
+  src->pub.resync_to_restart = jpeg_resync_to_restart; /* use default method */
+  src->pub.term_source = term_mmap_source;
+  src->map = (JOCTET *) map;
+  src->mapsize = (size_t) st.st_size;
+  src->pub.bytes_in_buffer = 0; /* forces fill_input_buffer on first read */
+  src->pub.next_input_byte = NULL; /* until mapping handed out */
+#else
+  jpeg_stdio_src(cinfo, infile);
+#endif
+}
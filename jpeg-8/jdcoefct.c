@@ -24,6 +24,23 @@
 #undef BLOCK_SMOOTHING_SUPPORTED
 #endif
 
+/* Threaded decoding of restart intervals needs the full-image buffer: */
+#if !defined(D_MULTISCAN_FILES_SUPPORTED) || defined(NO_PTHREADS)
+#undef D_PARALLEL_RESTART_SUPPORTED
+#endif
+
+#ifdef D_PARALLEL_RESTART_SUPPORTED
+#include <pthread.h>
+#include <unistd.h>		/* for sysconf */
+
+#ifndef MAX_RESTART_THREADS	/* most threads used to decode one scan */
+#define MAX_RESTART_THREADS  16
+#endif
+#ifndef RESTART_THREADS		/* threads wanted if restart_threads is 0 */
+#define RESTART_THREADS  ((int) sysconf(_SC_NPROCESSORS_ONLN))
+#endif
+#endif
+
 /* Private buffer controller object */
 
 typedef struct {
@@ -53,6 +70,16 @@ typedef struct {
   jvirt_barray_ptr whole_image[MAX_COMPONENTS];
 #endif
 
+#ifdef D_PARALLEL_RESTART_SUPPORTED
+  /* When a scan is decoded by several threads at once, each component of
+   * the scan must be wholly in memory; these are its block rows.
+   */
+  JBLOCKARRAY scan_buffer[MAX_COMPS_IN_SCAN];
+  const JOCTET ** interval;	/* start of each restart interval */
+  JDIMENSION interval_size;	/* allocated length of interval[] */
+  boolean try_parallel;		/* nothing consumed yet in this scan? */
+#endif
+
 #ifdef BLOCK_SMOOTHING_SUPPORTED
   /* When doing block smoothing, we latch coefficient Al values here */
   int * coef_bits_latch;
@@ -107,6 +134,11 @@ start_iMCU_row (j_decompress_ptr cinfo)
 METHODDEF(void)
 start_input_pass (j_decompress_ptr cinfo)
 {
+#ifdef D_PARALLEL_RESTART_SUPPORTED
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+
+  coef->try_parallel = TRUE;
+#endif
   cinfo->input_iMCU_row = 0;
   start_iMCU_row(cinfo);
 }
@@ -235,6 +267,215 @@ dummy_consume_data (j_decompress_ptr cinfo)
 
 #ifdef D_MULTISCAN_FILES_SUPPORTED
 
+#ifdef D_PARALLEL_RESTART_SUPPORTED
+
+/*
+ * Threaded decoding of a scan with restart markers.
+ *
+ * Each restart interval can be decoded on its own (see decode_interval in
+ * the entropy decoder), so when the whole scan is already in the source
+ * buffer (memory or memory-mapped source) we find the RSTn markers, split
+ * the intervals between threads, and let each thread decode straight into
+ * the full-image buffer.  The calling thread waits for all of them, then
+ * skips to the marker that follows the scan.  Whenever this is not possible
+ * we fall back on the ordinary MCU-row by MCU-row decoding.
+ */
+
+typedef struct {
+  j_decompress_ptr cinfo;
+  const JOCTET ** interval;	/* start of each interval, then end of scan */
+  JDIMENSION first_interval;	/* intervals [first,last) for this thread */
+  JDIMENSION last_interval;
+  JDIMENSION total_MCUs;	/* MCUs in the scan */
+} interval_job;
+
+
+METHODDEF(void)
+locate_MCU (j_decompress_ptr cinfo, JDIMENSION MCU_num, JBLOCKROW *MCU_data)
+/* Point MCU_data at the blocks of MCU number MCU_num of the scan */
+{
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+  JDIMENSION MCU_row = MCU_num / cinfo->MCUs_per_row;
+  JDIMENSION MCU_col = MCU_num % cinfo->MCUs_per_row;
+  int blkn, ci, xindex, yindex;
+  JBLOCKROW buffer_ptr;
+  jpeg_component_info *compptr;
+
+  /* Same layout as in consume_data: an MCU row spans MCU_height block rows
+   * (v_samp_factor for an interleaved scan, 1 otherwise).
+   */
+  blkn = 0;
+  for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
+    compptr = cinfo->cur_comp_info[ci];
+    for (yindex = 0; yindex < compptr->MCU_height; yindex++) {
+      buffer_ptr = coef->scan_buffer[ci][MCU_row * compptr->MCU_height + yindex]
+		   + MCU_col * compptr->MCU_width;
+      for (xindex = 0; xindex < compptr->MCU_width; xindex++) {
+	MCU_data[blkn++] = buffer_ptr++;
+      }
+    }
+  }
+}
+
+
+LOCAL(void *)
+decode_intervals (void * arg)
+/* Thread body: decode a run of consecutive restart intervals */
+{
+  interval_job * job = (interval_job *) arg;
+  j_decompress_ptr cinfo = job->cinfo;
+  JDIMENSION i, start_MCU, num_MCUs;
+
+  for (i = job->first_interval; i < job->last_interval; i++) {
+    start_MCU = i * cinfo->restart_interval;
+    num_MCUs = job->total_MCUs - start_MCU;
+    if (num_MCUs > cinfo->restart_interval)
+      num_MCUs = cinfo->restart_interval;
+    /* Cannot suspend: the interval is complete in memory */
+    (void) (*cinfo->entropy->decode_interval)
+      (cinfo, job->interval[i], (size_t) (job->interval[i+1] - job->interval[i]),
+       start_MCU, num_MCUs, locate_MCU);
+  }
+  return NULL;
+}
+
+
+LOCAL(const JOCTET *)
+find_intervals (j_decompress_ptr cinfo, const JOCTET ** interval,
+		JDIMENSION num_intervals)
+/* Find the num_intervals restart intervals of the scan in the source buffer.
+ * interval[i] is set to the start of interval i, interval[num_intervals] to
+ * just past the marker ending the scan.  Returns the position of that
+ * marker, or NULL if the scan does not end within the buffer or its RSTn
+ * markers are not the expected ones.
+ */
+{
+  const JOCTET * ptr = cinfo->src->next_input_byte;
+  const JOCTET * end = ptr + cinfo->src->bytes_in_buffer;
+  const JOCTET * marker;
+  JDIMENSION n = 0;
+  int c;
+
+  interval[0] = ptr;
+  for (;;) {
+    marker = (const JOCTET *) memchr((const void *) ptr, 0xFF,
+				     (size_t) (end - ptr));
+    if (marker == NULL)
+      return NULL;
+    /* Skip any padding FF's, as jpeg_fill_bit_buffer does */
+    ptr = marker;
+    do {
+      if (++ptr == end)
+	return NULL;
+      c = GETJOCTET(*ptr);
+    } while (c == 0xFF);
+    ptr++;
+
+    if (c == 0)			/* FF/00 represents an FF data byte */
+      continue;
+    if (c >= JPEG_RST0 && c <= JPEG_RST0 + 7) {
+      if (c != JPEG_RST0 + (int) (n & 7) || ++n == num_intervals)
+	return NULL;
+      interval[n] = ptr;
+      continue;
+    }
+    /* Any other marker ends the scan */
+    if (n != num_intervals - 1)
+      return NULL;
+    interval[num_intervals] = ptr;
+    return marker;
+  }
+}
+
+
+LOCAL(boolean)
+consume_data_parallel (j_decompress_ptr cinfo)
+/* Decode the whole current scan, its restart intervals spread over threads.
+ * Returns FALSE, having consumed nothing, if this cannot be done.
+ */
+{
+  my_coef_ptr coef = (my_coef_ptr) cinfo->coef;
+  JDIMENSION total_MCUs, num_intervals, row;
+  int ci, t, num_threads, started;
+  const JOCTET * marker;
+  JBLOCKARRAY buffer;
+  jpeg_component_info *compptr;
+  pthread_t thread[MAX_RESTART_THREADS];
+  interval_job job[MAX_RESTART_THREADS];
+
+  if (cinfo->restart_interval == 0 ||
+      cinfo->entropy->decode_interval == NULL ||
+      cinfo->unread_marker != 0)
+    return FALSE;
+
+  total_MCUs = cinfo->MCUs_per_row * cinfo->MCU_rows_in_scan;
+  num_intervals = (total_MCUs + cinfo->restart_interval - 1) /
+		  cinfo->restart_interval;
+  num_threads = cinfo->restart_threads > 0 ? cinfo->restart_threads :
+		RESTART_THREADS;
+  if (num_threads > MAX_RESTART_THREADS)
+    num_threads = MAX_RESTART_THREADS;
+  if ((JDIMENSION) num_threads > num_intervals)
+    num_threads = (int) num_intervals;
+  if (num_threads < 2)
+    return FALSE;
+
+  if (coef->interval_size < num_intervals + 1) {
+    coef->interval = (const JOCTET **) (*cinfo->mem->alloc_large)
+      ((j_common_ptr) cinfo, JPOOL_IMAGE,
+       (size_t) (num_intervals + 1) * SIZEOF(const JOCTET *));
+    coef->interval_size = num_intervals + 1;
+  }
+  marker = find_intervals(cinfo, coef->interval, num_intervals);
+  if (marker == NULL)
+    return FALSE;
+
+  /* Check that each component of the scan is wholly in memory, with its
+   * rows in one pointer array; this also gets them pre-zeroed.
+   */
+  for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
+    compptr = cinfo->cur_comp_info[ci];
+    for (row = 0; row < cinfo->total_iMCU_rows; row++) {
+      buffer = (*cinfo->mem->access_virt_barray)
+	((j_common_ptr) cinfo, coef->whole_image[compptr->component_index],
+	 row * compptr->v_samp_factor,
+	 (JDIMENSION) compptr->v_samp_factor, TRUE);
+      if (row == 0)
+	coef->scan_buffer[ci] = buffer;
+      else if (buffer != coef->scan_buffer[ci] + row * compptr->v_samp_factor)
+	return FALSE;
+    }
+  }
+
+  for (t = 0; t < num_threads; t++) {
+    job[t].cinfo = cinfo;
+    job[t].interval = coef->interval;
+    job[t].first_interval = num_intervals * t / num_threads;
+    job[t].last_interval = num_intervals * (t + 1) / num_threads;
+    job[t].total_MCUs = total_MCUs;
+  }
+  /* The calling thread takes the first share, and any share whose thread
+   * could not be created.
+   */
+  for (started = 1; started < num_threads; started++)
+    if (pthread_create(&thread[started], NULL, decode_intervals,
+		       (void *) &job[started]) != 0)
+      break;
+  decode_intervals((void *) &job[0]);
+  for (t = started; t < num_threads; t++)
+    decode_intervals((void *) &job[t]);
+  for (t = 1; t < started; t++)
+    pthread_join(thread[t], NULL);
+
+  /* Leave the source at the marker following the scan */
+  cinfo->src->bytes_in_buffer -= (size_t) (marker - cinfo->src->next_input_byte);
+  cinfo->src->next_input_byte = marker;
+  return TRUE;
+}
+
+#endif /* D_PARALLEL_RESTART_SUPPORTED */
+
+
 /*
  * Consume input data and store it in the full-image coefficient buffer.
  * We read as much as one fully interleaved MCU row ("iMCU" row) per call,
@@ -253,6 +494,20 @@ consume_data (j_decompress_ptr cinfo)
   JBLOCKROW buffer_ptr;
   jpeg_component_info *compptr;
 
+#ifdef D_PARALLEL_RESTART_SUPPORTED
+  /* On the first call for a scan, try to decode all of it at once,
+   * unless the application reads the image incrementally.
+   */
+  if (coef->try_parallel) {
+    coef->try_parallel = FALSE;
+    if (! coef->pub.incremental && consume_data_parallel(cinfo)) {
+      cinfo->input_iMCU_row = cinfo->total_iMCU_rows;
+      (*cinfo->inputctl->finish_input_pass) (cinfo);
+      return JPEG_SCAN_COMPLETED;
+    }
+  }
+#endif
+
   /* Align the virtual buffers for the components used in this scan. */
   for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
     compptr = cinfo->cur_comp_info[ci];
@@ -685,9 +940,15 @@ jinit_d_coef_controller (j_decompress_ptr cinfo, boolean need_full_buffer)
   cinfo->coef = (struct jpeg_d_coef_controller *) coef;
   coef->pub.start_input_pass = start_input_pass;
   coef->pub.start_output_pass = start_output_pass;
+  coef->pub.incremental = FALSE;
 #ifdef BLOCK_SMOOTHING_SUPPORTED
   coef->coef_bits_latch = NULL;
 #endif
+#ifdef D_PARALLEL_RESTART_SUPPORTED
+  coef->interval = NULL;
+  coef->interval_size = 0;
+  coef->try_parallel = FALSE;
+#endif
 
   /* Create the coefficient buffer. */
   if (need_full_buffer) {
@@ -23,7 +23,7 @@
 
 /* Derived data constructed for each Huffman table */
 
-#define HUFF_LOOKAHEAD	8	/* # of bits of lookahead */
+#define HUFF_LOOKAHEAD	9	/* # of bits of lookahead */
 
 typedef struct {
   /* Basic tables: (element [0] of each array is unused) */
@@ -45,6 +45,12 @@ typedef struct {
    */
   int look_nbits[1<<HUFF_LOOKAHEAD]; /* # bits, or 0 if too long */
   UINT8 look_sym[1<<HUFF_LOOKAHEAD]; /* symbol, or unused */
+
+  /* AC tables only: when the next HUFF_LOOKAHEAD bits hold a whole nonzero
+   * coefficient (code plus magnitude bits), its value, zero run and total
+   * length, packed as  value << 8 | run << 4 | length;  0 otherwise.
+   */
+  int look_ac[1<<HUFF_LOOKAHEAD];
 } d_derived_tbl;
 
 
@@ -66,16 +72,28 @@ typedef struct {
  * necessary.
  */
 
-typedef INT32 bit_buf_type;	/* type of bit-extraction buffer */
-#define BIT_BUF_SIZE  32	/* size of buffer in bits */
-
-/* If long is > 32 bits on your machine, and shifting/masking longs is
- * reasonably fast, making bit_buf_type be long and setting BIT_BUF_SIZE
- * appropriately should be a win.  Unfortunately we can't define the size
- * with something like  #define BIT_BUF_SIZE (sizeof(bit_buf_type)*8)
+/* On 64-bit machines a 64-bit buffer is a clear win: it is refilled about
+ * half as often, and when the next 8 source bytes hold no 0xFF (so no
+ * stuffed zero or marker to look for) they are loaded in one go.
+ * Unfortunately we can't define the size with something like
+ *  #define BIT_BUF_SIZE (sizeof(bit_buf_type)*8)
  * because not all machines measure sizeof in 8-bit bytes.
  */
 
+#ifndef NO_BIT_BUF_64
+#if defined(_LP64) || defined(__LP64__) || defined(_WIN64)
+#define BIT_BUF_64
+#endif
+#endif
+
+#ifdef BIT_BUF_64
+typedef unsigned long long bit_buf_type; /* type of bit-extraction buffer */
+#define BIT_BUF_SIZE  64	/* size of buffer in bits */
+#else
+typedef INT32 bit_buf_type;	/* type of bit-extraction buffer */
+#define BIT_BUF_SIZE  32	/* size of buffer in bits */
+#endif
+
 typedef struct {		/* Bitreading state saved across MCUs */
   bit_buf_type get_buffer;	/* current bit-extraction buffer */
   int bits_left;		/* # of unused bits in it */
@@ -187,6 +205,23 @@ slowlabel: \
   } \
 }
 
+/*
+ * Fast path for AC coefficients: a short code and its magnitude bits are
+ * decoded at once through the look_ac table.  result is set to the packed
+ * look_ac entry, the bits being consumed, or to 0 if HUFF_DECODE is needed.
+ */
+
+#define HUFF_DECODE_AC_FAST(result,state,htbl,failaction) \
+{ if (bits_left < HUFF_LOOKAHEAD) { \
+    if (! jpeg_fill_bit_buffer(&state,get_buffer,bits_left, 0)) {failaction;} \
+    get_buffer = state.get_buffer; bits_left = state.bits_left; \
+  } \
+  if (bits_left < HUFF_LOOKAHEAD) \
+    result = 0; \
+  else if ((result = htbl->look_ac[PEEK_BITS(HUFF_LOOKAHEAD)]) != 0) \
+    DROP_BITS(result & 15); \
+}
+
 
 /*
  * Expanded entropy decoder object for Huffman decoding.
@@ -424,6 +459,27 @@ jpeg_make_d_derived_tbl (j_decompress_ptr cinfo, boolean isDC, int tblno,
     }
   }
 
+  /* For AC tables, also decode the magnitude bits that follow a short code
+   * whenever they fit in the lookahead: the common small coefficients then
+   * cost a single table lookup.
+   */
+  if (! isDC) {
+    MEMZERO(dtbl->look_ac, SIZEOF(dtbl->look_ac));
+    for (lookbits = 0; lookbits < (1<<HUFF_LOOKAHEAD); lookbits++) {
+      int nb = dtbl->look_nbits[lookbits];
+      int run = dtbl->look_sym[lookbits] >> 4;
+      int size = dtbl->look_sym[lookbits] & 15;
+      int value;
+
+      if (nb == 0 || size == 0 || nb + size > HUFF_LOOKAHEAD)
+	continue;
+      value = (lookbits >> (HUFF_LOOKAHEAD - nb - size)) & ((1 << size) - 1);
+      if (value < (1 << (size - 1)))	/* HUFF_EXTEND */
+	value -= (1 << size) - 1;
+      dtbl->look_ac[lookbits] = value * 256 + (run << 4) + nb + size;
+    }
+  }
+
   /* Validate symbols as being reasonable.
    * For AC tables, we make no check, but accept all byte values 0..255.
    * For DC tables, we require the symbols to be in range 0..15.
@@ -477,6 +533,36 @@ jpeg_fill_bit_buffer (bitread_working_state * state,
   /* We fail to do so only if we hit a marker or are forced to suspend. */
 
   if (cinfo->unread_marker == 0) {	/* cannot advance past a marker */
+#ifdef BIT_BUF_64
+    /* Fast path: if the next 8 bytes hold no 0xFF, take as many of them as
+     * the buffer can hold (at least enough to reach MIN_GET_BITS).
+     */
+    if (bytes_in_buffer >= 8) {
+      bit_buf_type word, t;
+      int nbytes;
+
+      word = ((bit_buf_type) GETJOCTET(next_input_byte[0]) << 56) |
+	     ((bit_buf_type) GETJOCTET(next_input_byte[1]) << 48) |
+	     ((bit_buf_type) GETJOCTET(next_input_byte[2]) << 40) |
+	     ((bit_buf_type) GETJOCTET(next_input_byte[3]) << 32) |
+	     ((bit_buf_type) GETJOCTET(next_input_byte[4]) << 24) |
+	     ((bit_buf_type) GETJOCTET(next_input_byte[5]) << 16) |
+	     ((bit_buf_type) GETJOCTET(next_input_byte[6]) << 8) |
+	      (bit_buf_type) GETJOCTET(next_input_byte[7]);
+      t = ~word;		/* a 0xFF byte becomes a zero byte */
+      if (((t - 0x0101010101010101ULL) & ~t & 0x8080808080808080ULL) == 0) {
+	nbytes = (BIT_BUF_SIZE - bits_left) >> 3;
+	if (nbytes == 8)
+	  get_buffer = word;
+	else
+	  get_buffer = (get_buffer << (nbytes << 3)) |
+		       (word >> ((8 - nbytes) << 3));
+	bits_left += nbytes << 3;
+	next_input_byte += nbytes;
+	bytes_in_buffer -= nbytes;
+      }
+    }
+#endif
     while (bits_left < MIN_GET_BITS) {
       register int c;
 
@@ -1063,6 +1149,7 @@ decode_mcu_sub (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
   int Se, blkn;
   BITREAD_STATE_VARS;
   savable_state state;
+  SHIFT_TEMPS
 
   /* Process restart marker if needed; may have to suspend */
   if (cinfo->restart_interval) {
@@ -1116,6 +1203,12 @@ decode_mcu_sub (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
 	/* Section F.2.2.2: decode the AC coefficients */
 	/* Since zeroes are skipped, output area must be cleared beforehand */
 	for (; k < coef_limit; k++) {
+	  HUFF_DECODE_AC_FAST(s, br_state, htbl, return FALSE);
+	  if (s) {
+	    k += (s >> 4) & 15;
+	    (*block)[natural_order[k]] = (JCOEF) RIGHT_SHIFT((INT32) s, 8);
+	    continue;
+	  }
 	  HUFF_DECODE(s, br_state, htbl, return FALSE, label2);
 
 	  r = s >> 4;
@@ -1147,6 +1240,11 @@ decode_mcu_sub (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
       /* Section F.2.2.2: decode the AC coefficients */
       /* In this path we just discard the values */
       for (; k <= Se; k++) {
+	HUFF_DECODE_AC_FAST(s, br_state, htbl, return FALSE);
+	if (s) {
+	  k += (s >> 4) & 15;
+	  continue;
+	}
 	HUFF_DECODE(s, br_state, htbl, return FALSE, label3);
 
 	r = s >> 4;
@@ -1190,6 +1288,7 @@ decode_mcu (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
   int blkn;
   BITREAD_STATE_VARS;
   savable_state state;
+  SHIFT_TEMPS
 
   /* Process restart marker if needed; may have to suspend */
   if (cinfo->restart_interval) {
@@ -1240,6 +1339,12 @@ decode_mcu (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
 	/* Section F.2.2.2: decode the AC coefficients */
 	/* Since zeroes are skipped, output area must be cleared beforehand */
 	for (; k < coef_limit; k++) {
+	  HUFF_DECODE_AC_FAST(s, br_state, htbl, return FALSE);
+	  if (s) {
+	    k += (s >> 4) & 15;
+	    (*block)[jpeg_natural_order[k]] = (JCOEF) RIGHT_SHIFT((INT32) s, 8);
+	    continue;
+	  }
 	  HUFF_DECODE(s, br_state, htbl, return FALSE, label2);
 
 	  r = s >> 4;
@@ -1271,6 +1376,11 @@ decode_mcu (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
       /* Section F.2.2.2: decode the AC coefficients */
       /* In this path we just discard the values */
       for (; k < DCTSIZE2; k++) {
+	HUFF_DECODE_AC_FAST(s, br_state, htbl, return FALSE);
+	if (s) {
+	  k += (s >> 4) & 15;
+	  continue;
+	}
 	HUFF_DECODE(s, br_state, htbl, return FALSE, label3);
 
 	r = s >> 4;
@@ -1302,6 +1412,109 @@ decode_mcu (j_decompress_ptr cinfo, JBLOCKROW *MCU_data)
 }
 
 
+/*
+ * Decoding of a single restart interval held in memory.
+ *
+ * All the state that changes while decoding (bit buffer, DC predictions,
+ * EOB run, data source, unread marker) is reset at a restart marker, so an
+ * interval can be decoded from private copies of the decompression and
+ * entropy objects, without touching the shared ones.  The coefficient
+ * controller uses this to decode the intervals of a scan on several threads;
+ * the shared objects are only read, and must not change meanwhile.
+ */
+
+METHODDEF(void)
+init_interval_source (j_decompress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+
+METHODDEF(boolean)
+fill_interval_buffer (j_decompress_ptr cinfo)
+{
+  static const JOCTET mybuffer[4] = {
+    (JOCTET) 0xFF, (JOCTET) JPEG_EOI, 0, 0
+  };
+
+  /* The interval ends with the marker that terminates it; running past the
+   * given bytes means the data is truncated.  Insert a fake EOI marker.
+   */
+  WARNMS(cinfo, JWRN_JPEG_EOF);
+
+  cinfo->src->next_input_byte = mybuffer;
+  cinfo->src->bytes_in_buffer = 2;
+
+  return TRUE;
+}
+
+
+METHODDEF(void)
+skip_interval_data (j_decompress_ptr cinfo, long num_bytes)
+{
+  /* never called: the entropy decoder does not skip data */
+}
+
+
+METHODDEF(void)
+term_interval_source (j_decompress_ptr cinfo)
+{
+  /* no work necessary here */
+}
+
+
+METHODDEF(boolean)
+decode_interval (j_decompress_ptr cinfo, const JOCTET * data, size_t datalen,
+		 JDIMENSION start_MCU, JDIMENSION num_MCUs,
+		 locate_MCU_method_ptr locate_MCU)
+{
+  struct jpeg_decompress_struct local;
+  struct jpeg_error_mgr err;
+  struct jpeg_source_mgr src;
+  huff_entropy_decoder entropy;
+  JBLOCKROW MCU_data[D_MAX_BLOCKS_IN_MCU];
+  JDIMENSION MCU_num;
+  int ci;
+
+  /* Private copies of everything decode_mcu may modify */
+  local = *cinfo;
+  err = *cinfo->err;
+  local.err = &err;
+  entropy = *((huff_entropy_ptr) cinfo->entropy);
+  local.entropy = (struct jpeg_entropy_decoder *) &entropy;
+
+  src.next_input_byte = data;
+  src.bytes_in_buffer = datalen;
+  src.init_source = init_interval_source;
+  src.fill_input_buffer = fill_interval_buffer;
+  src.skip_input_data = skip_interval_data;
+  src.resync_to_restart = jpeg_resync_to_restart;
+  src.term_source = term_interval_source;
+  local.src = &src;
+  local.unread_marker = 0;
+
+  /* Same state as after process_restart */
+  entropy.bitstate.bits_left = 0;
+  entropy.bitstate.get_buffer = 0;
+  for (ci = 0; ci < cinfo->comps_in_scan; ci++)
+    entropy.saved.last_dc_val[ci] = 0;
+  entropy.saved.EOBRUN = 0;
+  entropy.insufficient_data = FALSE;
+  /* The interval holds num_MCUs MCUs: the counter never reaches 0 before
+   * the last one, so decode_mcu never looks for a restart marker.
+   */
+  entropy.restarts_to_go = num_MCUs;
+
+  for (MCU_num = start_MCU; MCU_num < start_MCU + num_MCUs; MCU_num++) {
+    (*locate_MCU) (&local, MCU_num, MCU_data);
+    if (! (*entropy.pub.decode_mcu) (&local, MCU_data))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+
 /*
  * Initialize for a Huffman-compressed scan.
  */
@@ -1516,6 +1729,7 @@ jinit_huff_decoder (j_decompress_ptr cinfo)
 				SIZEOF(huff_entropy_decoder));
   cinfo->entropy = (struct jpeg_entropy_decoder *) entropy;
   entropy->pub.start_pass = start_pass_huff_decoder;
+  entropy->pub.decode_interval = decode_interval;
 
   if (cinfo->progressive_mode) {
     /* Create progression status table */
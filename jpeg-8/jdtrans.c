@@ -18,6 +18,9 @@
 
 /* Forward declarations */
 LOCAL(void) transdecode_master_selection JPP((j_decompress_ptr cinfo));
+LOCAL(int) consume_coefficients JPP((j_decompress_ptr cinfo));
+LOCAL(void) count_master_selection JPP((j_decompress_ptr cinfo,
+					jpeg_coef_counts * counts));
 
 
 /*
@@ -52,25 +55,13 @@ jpeg_read_coefficients (j_decompress_ptr cinfo)
   }
   if (cinfo->global_state == DSTATE_RDCOEFS) {
     /* Absorb whole file into the coef buffer */
+    cinfo->coef->incremental = FALSE;
     for (;;) {
-      int retcode;
-      /* Call progress monitor hook if present */
-      if (cinfo->progress != NULL)
-	(*cinfo->progress->progress_monitor) ((j_common_ptr) cinfo);
-      /* Absorb some more input */
-      retcode = (*cinfo->inputctl->consume_input) (cinfo);
+      int retcode = consume_coefficients(cinfo);
       if (retcode == JPEG_SUSPENDED)
 	return NULL;
       if (retcode == JPEG_REACHED_EOI)
 	break;
-      /* Advance progress counter if appropriate */
-      if (cinfo->progress != NULL &&
-	  (retcode == JPEG_ROW_COMPLETED || retcode == JPEG_REACHED_SOS)) {
-	if (++cinfo->progress->pass_counter >= cinfo->progress->pass_limit) {
-	  /* startup underestimated number of scans; ratchet up one scan */
-	  cinfo->progress->pass_limit += (long) cinfo->total_iMCU_rows;
-	}
-      }
     }
     /* Set state so that jpeg_finish_decompress does the right thing */
     cinfo->global_state = DSTATE_STOPPING;
@@ -89,6 +80,86 @@ jpeg_read_coefficients (j_decompress_ptr cinfo)
 }
 
 
+/*
+ * Incremental reading of the coefficient arrays, for applications that
+ * need only the top of the image (e.g. to read back data hidden in its
+ * first blocks).  jpeg_read_header must be completed before calling
+ * jpeg_start_coefficients, which sets up the modules and returns the
+ * virtual-array descriptors without reading any compressed data.  Each call
+ * to jpeg_consume_coefficients then absorbs input up to the end of the next
+ * iMCU row or the next marker, and returns the code of consume_input
+ * (JPEG_REACHED_EOI once the whole file has been read).
+ *
+ * After a call returning JPEG_ROW_COMPLETED or JPEG_SCAN_COMPLETED, the
+ * first input_iMCU_row * v_samp_factor block rows of each component of the
+ * current scan are decoded.  In sequential mode each component is coded in
+ * a single scan, so those rows are final; in progressive mode the
+ * coefficients are final only at JPEG_REACHED_EOI.
+ *
+ * The application may stop at any point and release the arrays with
+ * jpeg_abort_decompress, or call jpeg_read_coefficients to absorb the rest
+ * of the file.
+ */
+
+GLOBAL(jvirt_barray_ptr *)
+jpeg_start_coefficients (j_decompress_ptr cinfo)
+{
+  if (cinfo->global_state == DSTATE_READY) {
+    /* First call: initialize active modules */
+    transdecode_master_selection(cinfo);
+    cinfo->global_state = DSTATE_RDCOEFS;
+  }
+  if (cinfo->global_state != DSTATE_RDCOEFS &&
+      cinfo->global_state != DSTATE_STOPPING)
+    ERREXIT1(cinfo, JERR_BAD_STATE, cinfo->global_state);
+  return cinfo->coef->coef_arrays;
+}
+
+
+GLOBAL(int)
+jpeg_consume_coefficients (j_decompress_ptr cinfo)
+{
+  int retcode;
+
+  if (cinfo->global_state == DSTATE_STOPPING)
+    return JPEG_REACHED_EOI;	/* everything already absorbed */
+  if (cinfo->global_state != DSTATE_RDCOEFS)
+    ERREXIT1(cinfo, JERR_BAD_STATE, cinfo->global_state);
+  /* One iMCU row per call: no scan is decoded at once (see jdcoefct.c) */
+  cinfo->coef->incremental = TRUE;
+  retcode = consume_coefficients(cinfo);
+  if (retcode == JPEG_REACHED_EOI)
+    cinfo->global_state = DSTATE_STOPPING;
+  return retcode;
+}
+
+
+/*
+ * Absorb some more input into the coef buffer, with progress monitoring.
+ */
+
+LOCAL(int)
+consume_coefficients (j_decompress_ptr cinfo)
+{
+  int retcode;
+
+  /* Call progress monitor hook if present */
+  if (cinfo->progress != NULL)
+    (*cinfo->progress->progress_monitor) ((j_common_ptr) cinfo);
+  /* Absorb some more input */
+  retcode = (*cinfo->inputctl->consume_input) (cinfo);
+  /* Advance progress counter if appropriate */
+  if (cinfo->progress != NULL &&
+      (retcode == JPEG_ROW_COMPLETED || retcode == JPEG_REACHED_SOS)) {
+    if (++cinfo->progress->pass_counter >= cinfo->progress->pass_limit) {
+      /* startup underestimated number of scans; ratchet up one scan */
+      cinfo->progress->pass_limit += (long) cinfo->total_iMCU_rows;
+    }
+  }
+  return retcode;
+}
+
+
 /*
  * Master selection of decompression modules for transcoding.
  * This substitutes for jdmaster.c's initialization of the full decompressor.
@@ -138,3 +209,211 @@ transdecode_master_selection (j_decompress_ptr cinfo)
     cinfo->progress->total_passes = 1;
   }
 }
+
+
+/*
+ * Counting the coefficients without storing them.
+ *
+ * jpeg_count_coefficients reads a sequential file to the end, like
+ * jpeg_read_coefficients, but through a coefficient controller of its own:
+ * the entropy decoder puts each MCU in a one-MCU workspace, whose nonzero
+ * coefficients are counted before it is dropped.  No coefficient array is
+ * allocated, so the memory used does not depend on the image size.  The
+ * dummy blocks padding the MCUs at the right and bottom edges of an
+ * interleaved scan are not counted.
+ *
+ * jpeg_read_header must be completed before calling this.  A progressive
+ * file cannot be counted this way, since a coefficient is final only after
+ * the last scan refining it: FALSE is returned with nothing read past the
+ * header, and jpeg_read_coefficients may be called instead.  FALSE is also
+ * returned on suspension; call again to resume.  Release the object with
+ * jpeg_abort_decompress or jpeg_destroy_decompress afterwards.
+ */
+
+typedef struct {
+  struct jpeg_d_coef_controller pub; /* public fields */
+
+  /* Location of the input side, as in jdcoefct.c */
+  JDIMENSION MCU_ctr;		/* counts MCUs processed in current row */
+  int MCU_vert_offset;		/* counts MCU rows within iMCU row */
+  int MCU_rows_per_iMCU_row;	/* number of such rows needed */
+
+  /* The workspace, D_MAX_BLOCKS_IN_MCU blocks */
+  JBLOCKROW MCU_buffer[D_MAX_BLOCKS_IN_MCU];
+
+  jpeg_coef_counts * counts;	/* where to add the counts */
+} my_count_controller;
+
+typedef my_count_controller * my_count_ptr;
+
+
+GLOBAL(boolean)
+jpeg_count_coefficients (j_decompress_ptr cinfo, jpeg_coef_counts * counts)
+{
+  if (cinfo->global_state == DSTATE_READY) {
+    if (cinfo->progressive_mode)
+      return FALSE;		/* needs the whole image in memory */
+    /* First call: initialize active modules */
+    counts->num_blocks = 0;
+    counts->nonzero_dc = 0;
+    counts->nonzero_ac = 0;
+    count_master_selection(cinfo, counts);
+    cinfo->global_state = DSTATE_RDCOEFS;
+  }
+  if (cinfo->global_state != DSTATE_RDCOEFS)
+    ERREXIT1(cinfo, JERR_BAD_STATE, cinfo->global_state);
+  /* Absorb whole file, counting as we go */
+  for (;;) {
+    int retcode = consume_coefficients(cinfo);
+    if (retcode == JPEG_SUSPENDED)
+      return FALSE;
+    if (retcode == JPEG_REACHED_EOI)
+      break;
+  }
+  cinfo->global_state = DSTATE_STOPPING;
+  return TRUE;
+}
+
+
+LOCAL(void)
+start_count_row (j_decompress_ptr cinfo)
+/* Reset within-iMCU-row counters for a new row */
+{
+  my_count_ptr coef = (my_count_ptr) cinfo->coef;
+
+  /* Same as start_iMCU_row in jdcoefct.c: in a noninterleaved scan, an
+   * iMCU row has v_samp_factor MCU rows, fewer at the bottom of the image.
+   */
+  if (cinfo->comps_in_scan > 1) {
+    coef->MCU_rows_per_iMCU_row = 1;
+  } else {
+    if (cinfo->input_iMCU_row < (cinfo->total_iMCU_rows-1))
+      coef->MCU_rows_per_iMCU_row = cinfo->cur_comp_info[0]->v_samp_factor;
+    else
+      coef->MCU_rows_per_iMCU_row = cinfo->cur_comp_info[0]->last_row_height;
+  }
+
+  coef->MCU_ctr = 0;
+  coef->MCU_vert_offset = 0;
+}
+
+
+METHODDEF(void)
+start_count_pass (j_decompress_ptr cinfo)
+{
+  cinfo->input_iMCU_row = 0;
+  start_count_row(cinfo);
+}
+
+
+METHODDEF(int)
+consume_count (j_decompress_ptr cinfo)
+/* Decode and count one iMCU row of the current scan */
+{
+  my_count_ptr coef = (my_count_ptr) cinfo->coef;
+  jpeg_coef_counts * counts = coef->counts;
+  JDIMENSION MCU_col_num;	/* index of current MCU within row */
+  int blkn, ci, xindex, yindex, yoffset, k;
+  JDIMENSION col, row;
+  JCOEFPTR block;
+  jpeg_component_info *compptr;
+
+  for (yoffset = coef->MCU_vert_offset; yoffset < coef->MCU_rows_per_iMCU_row;
+       yoffset++) {
+    for (MCU_col_num = coef->MCU_ctr; MCU_col_num < cinfo->MCUs_per_row;
+	 MCU_col_num++) {
+      /* The entropy decoder expects the workspace to be zeroed */
+      FMEMZERO((void FAR *) coef->MCU_buffer[0],
+	       (size_t) cinfo->blocks_in_MCU * SIZEOF(JBLOCK));
+      if (! (*cinfo->entropy->decode_mcu) (cinfo, coef->MCU_buffer)) {
+	/* Suspension forced; update state counters and exit */
+	coef->MCU_vert_offset = yoffset;
+	coef->MCU_ctr = MCU_col_num;
+	return JPEG_SUSPENDED;
+      }
+      /* Count the real blocks of the MCU */
+      blkn = 0;
+      for (ci = 0; ci < cinfo->comps_in_scan; ci++) {
+	compptr = cinfo->cur_comp_info[ci];
+	for (yindex = 0; yindex < compptr->MCU_height; yindex++) {
+	  row = (cinfo->input_iMCU_row * compptr->v_samp_factor) +
+		(JDIMENSION) (yindex + yoffset);
+	  for (xindex = 0; xindex < compptr->MCU_width; xindex++, blkn++) {
+	    col = MCU_col_num * compptr->MCU_width + (JDIMENSION) xindex;
+	    if (row >= compptr->height_in_blocks ||
+		col >= compptr->width_in_blocks)
+	      continue;		/* dummy block */
+	    block = coef->MCU_buffer[blkn][0];
+	    counts->num_blocks++;
+	    counts->nonzero_dc += (block[0] != 0);
+	    for (k = 1; k < DCTSIZE2; k++)
+	      counts->nonzero_ac += (block[k] != 0);
+	  }
+	}
+      }
+    }
+    /* Completed an MCU row, but perhaps not an iMCU row */
+    coef->MCU_ctr = 0;
+  }
+  /* Completed the iMCU row, advance counters for next one */
+  if (++(cinfo->input_iMCU_row) < cinfo->total_iMCU_rows) {
+    start_count_row(cinfo);
+    return JPEG_ROW_COMPLETED;
+  }
+  /* Completed the scan */
+  (*cinfo->inputctl->finish_input_pass) (cinfo);
+  return JPEG_SCAN_COMPLETED;
+}
+
+
+/*
+ * Master selection of decompression modules for counting: as for
+ * transcoding, with the counting controller instead of jdcoefct.c.
+ */
+
+LOCAL(void)
+count_master_selection (j_decompress_ptr cinfo, jpeg_coef_counts * counts)
+{
+  my_count_ptr coef;
+  JBLOCKROW buffer;
+  int i;
+
+  cinfo->buffered_image = TRUE;
+  jpeg_core_output_dimensions(cinfo);
+
+  /* Entropy decoding: either Huffman or arithmetic coding. */
+  if (cinfo->arith_code)
+    jinit_arith_decoder(cinfo);
+  else {
+    jinit_huff_decoder(cinfo);
+  }
+
+  coef = (my_count_ptr)
+    (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				SIZEOF(my_count_controller));
+  cinfo->coef = (struct jpeg_d_coef_controller *) coef;
+  coef->pub.start_input_pass = start_count_pass;
+  coef->pub.consume_data = consume_count;
+  coef->pub.start_output_pass = NULL;	/* input side only */
+  coef->pub.decompress_data = NULL;
+  coef->pub.coef_arrays = NULL;
+  coef->pub.incremental = FALSE;
+  coef->counts = counts;
+  buffer = (JBLOCKROW)
+    (*cinfo->mem->alloc_large) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+				D_MAX_BLOCKS_IN_MCU * SIZEOF(JBLOCK));
+  for (i = 0; i < D_MAX_BLOCKS_IN_MCU; i++)
+    coef->MCU_buffer[i] = buffer + i;
+
+  /* Initialize input side of decompressor to consume first scan. */
+  (*cinfo->inputctl->start_input_pass) (cinfo);
+
+  /* Initialize progress monitoring: one pass per scan of a sequential file */
+  if (cinfo->progress != NULL) {
+    cinfo->progress->pass_counter = 0L;
+    cinfo->progress->pass_limit = (long) cinfo->total_iMCU_rows *
+      (cinfo->inputctl->has_multiple_scans ? cinfo->num_components : 1);
+    cinfo->progress->completed_passes = 0;
+    cinfo->progress->total_passes = 1;
+  }
+}
@@ -0,0 +1,195 @@
+/*
+ * jmemmap.c
+ *
+ * Copyright (C) 1992-1996, Thomas G. Lane.
+ * This file is part of the Independent JPEG Group's software.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file provides a POSIX implementation of the system-dependent
+ * portion of the JPEG memory manager.  Backing store is a sparse temporary
+ * file mapped into the address space with mmap(): reading and writing it
+ * are plain memory copies, and the kernel pages the data to and from disk
+ * as memory pressure requires.  As with jmemansi.c, the amount of memory
+ * available is set by the user (max_memory_to_use).
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jmemsys.h"		/* import the system-dependent declarations */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef HAVE_STDLIB_H		/* <stdlib.h> should declare malloc(),free() */
+extern void * malloc JPP((size_t size));
+extern void free JPP((void *ptr));
+extern char * getenv JPP((const char * name));
+#endif
+
+#ifndef USE_MMAP_MEMMGR		/* make sure user got configuration right */
+  You forgot to define USE_MMAP_MEMMGR in jconfig.h. /* deliberate syntax error */
+#endif
+
+
+/*
+ * Memory allocation and freeing are controlled by the regular library
+ * routines malloc() and free().
+ */
+
+GLOBAL(void *)
+jpeg_get_small (j_common_ptr cinfo, size_t sizeofobject)
+{
+  return (void *) malloc(sizeofobject);
+}
+
+GLOBAL(void)
+jpeg_free_small (j_common_ptr cinfo, void * object, size_t sizeofobject)
+{
+  free(object);
+}
+
+
+/*
+ * "Large" objects are treated the same as "small" ones.
+ */
+
+GLOBAL(void FAR *)
+jpeg_get_large (j_common_ptr cinfo, size_t sizeofobject)
+{
+  return (void FAR *) malloc(sizeofobject);
+}
+
+GLOBAL(void)
+jpeg_free_large (j_common_ptr cinfo, void FAR * object, size_t sizeofobject)
+{
+  free(object);
+}
+
+
+/*
+ * This routine computes the total memory space available for allocation.
+ * As in jmemansi.c, the user tells us (with a default value set at compile
+ * time, or max_memory_to_use set by the application).  By default there is
+ * no limit: virtual arrays stay wholly in memory, as with jmemnobs.c, unless
+ * the application lowers max_memory_to_use.
+ */
+
+#ifndef DEFAULT_MAX_MEM		/* so can override from makefile */
+#define DEFAULT_MAX_MEM		((long) (~0UL >> 1)) /* default: no limit */
+#endif
+
+GLOBAL(long)
+jpeg_mem_available (j_common_ptr cinfo, long min_bytes_needed,
+		    long max_bytes_needed, long already_allocated)
+{
+  return cinfo->mem->max_memory_to_use - already_allocated;
+}
+
+
+/*
+ * Backing store (mapped temporary file) management.
+ * Backing store objects are only used when the value returned by
+ * jpeg_mem_available is less than the total space needed.
+ *
+ * The file is created at its full size with ftruncate(), which allocates
+ * no disk blocks: only the parts actually written take space.  It is
+ * unlinked as soon as it is open, so nothing is left behind if the
+ * program dies.  The temporary directory is $TMPDIR, or TEMP_DIRECTORY.
+ */
+
+#ifndef TEMP_DIRECTORY		/* so can override from makefile */
+#define TEMP_DIRECTORY  "/tmp"	/* recommended setting for Unix */
+#endif
+
+
+METHODDEF(void)
+read_backing_store (j_common_ptr cinfo, backing_store_ptr info,
+		    void FAR * buffer_address,
+		    long file_offset, long byte_count)
+{
+  if (file_offset < 0 || byte_count > info->map_size - file_offset)
+    ERREXIT(cinfo, JERR_TFILE_READ);
+  MEMCOPY(buffer_address, (char *) info->map_base + file_offset,
+	  (size_t) byte_count);
+}
+
+
+METHODDEF(void)
+write_backing_store (j_common_ptr cinfo, backing_store_ptr info,
+		     void FAR * buffer_address,
+		     long file_offset, long byte_count)
+{
+  if (file_offset < 0 || byte_count > info->map_size - file_offset)
+    ERREXIT(cinfo, JERR_TFILE_WRITE);
+  MEMCOPY((char *) info->map_base + file_offset, buffer_address,
+	  (size_t) byte_count);
+}
+
+
+METHODDEF(void)
+close_backing_store (j_common_ptr cinfo, backing_store_ptr info)
+{
+  /* The file was unlinked when opened: it disappears with the mapping */
+  munmap(info->map_base, (size_t) info->map_size);
+  close(info->temp_fd);
+  TRACEMSS(cinfo, 1, JTRC_TFILE_CLOSE, info->temp_name);
+}
+
+
+/*
+ * Initial opening of a backing-store object.
+ */
+
+GLOBAL(void)
+jpeg_open_backing_store (j_common_ptr cinfo, backing_store_ptr info,
+			 long total_bytes_needed)
+{
+  const char * dir = getenv("TMPDIR");
+  void * map;
+  int fd;
+
+  if (dir == NULL || *dir == '\0' ||
+      strlen(dir) + sizeof("/JPGXXXXXX") > TEMP_NAME_LENGTH)
+    dir = TEMP_DIRECTORY;
+  sprintf(info->temp_name, "%s/JPGXXXXXX", dir);
+  if ((fd = mkstemp(info->temp_name)) < 0)
+    ERREXITS(cinfo, JERR_TFILE_CREATE, info->temp_name);
+  unlink(info->temp_name);
+
+  if (total_bytes_needed <= 0)	/* mmap() refuses empty mappings */
+    total_bytes_needed = 1;
+  if (ftruncate(fd, (off_t) total_bytes_needed) != 0 ||
+      (map = mmap(NULL, (size_t) total_bytes_needed, PROT_READ | PROT_WRITE,
+		  MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    ERREXITS(cinfo, JERR_TFILE_CREATE, info->temp_name);
+  }
+
+  info->temp_fd = fd;
+  info->map_base = map;
+  info->map_size = total_bytes_needed;
+  info->read_backing_store = read_backing_store;
+  info->write_backing_store = write_backing_store;
+  info->close_backing_store = close_backing_store;
+  TRACEMSS(cinfo, 1, JTRC_TFILE_OPEN, info->temp_name);
+}
+
+
+/*
+ * These routines take care of any system-dependent initialization and
+ * cleanup required.
+ */
+
+GLOBAL(long)
+jpeg_mem_init (j_common_ptr cinfo)
+{
+  return DEFAULT_MAX_MEM;	/* default for max_memory_to_use */
+}
+
+GLOBAL(void)
+jpeg_mem_term (j_common_ptr cinfo)
+{
+  /* no work */
+}
@@ -37,6 +37,10 @@ extern char * getenv JPP((const char * name));
 #endif
 #endif
 
+#ifndef NO_MMAP
+#include <sys/mman.h>		/* for madvise() */
+#endif
+
 
 /*
  * Some important notes:
@@ -136,6 +140,14 @@ typedef struct {
    * array routines.
    */
   JDIMENSION last_rowsperchunk;	/* from most recent alloc_sarray/barray */
+
+  /* Area of the contiguous block arrays (see realize_contiguous_barrays).
+   * It lives outside the pools so that it survives jpeg_abort and serves
+   * the next image of the same size without a new allocation.
+   */
+  char FAR * barray_area;	/* NULL if none */
+  size_t barray_area_size;	/* size as obtained from get_chunk */
+  boolean barray_area_busy;	/* in use by the arrays of the current image */
 } my_memory_mgr;
 
 typedef my_memory_mgr * my_mem_ptr;
@@ -226,6 +238,129 @@ out_of_memory (j_common_ptr cinfo, int which)
 }
 
 
+/*
+ * Arena mode.
+ *
+ * A program that handles many images creates and destroys one memory
+ * manager per image, so every pool goes back to the system-dependent
+ * allocator and is requested again for the next image.  In arena mode
+ * (see jpeg_mem_arena), the chunks released by free_pool and self_destruct
+ * are kept in a cache owned by the calling thread, and a chunk of exactly
+ * the requested size is taken from that cache before asking the system.
+ * Images of the same geometry make the same sequence of requests, so in
+ * steady state none of them reaches jpeg_get_small/jpeg_get_large.
+ * The cache holds at most ARENA_MAX_CHUNKS chunks and max_bytes bytes;
+ * the oldest chunks are released first.  Small and large chunks are never
+ * exchanged, since the system may get them from different heaps.
+ */
+
+#ifdef MEM_ARENA_SUPPORTED
+
+#ifndef ARENA_MAX_CHUNKS
+#define ARENA_MAX_CHUNKS  64	/* reading and writing an image take about 15 */
+#endif
+
+#ifndef THREAD_LOCAL
+#ifdef _MSC_VER
+#define THREAD_LOCAL  __declspec(thread)
+#else
+#define THREAD_LOCAL  __thread
+#endif
+#endif
+
+typedef struct {
+  void FAR * chunk;		/* released chunk */
+  size_t size;			/* its size, as given to jpeg_free_xxx */
+  boolean large;		/* TRUE if it came from jpeg_get_large */
+} arena_chunk;
+
+typedef struct {
+  long max_bytes;		/* 0 when arena mode is off */
+  long bytes;			/* total size of the cached chunks */
+  int count;			/* number of cached chunks */
+  arena_chunk chunk[ARENA_MAX_CHUNKS]; /* oldest first */
+} arena_cache;
+
+static THREAD_LOCAL arena_cache arena;
+
+
+LOCAL(void)
+arena_remove (int i)
+/* Drop entry i from the cache, keeping the others in age order */
+{
+  arena.bytes -= (long) arena.chunk[i].size;
+  arena.count--;
+  for (; i < arena.count; i++)
+    arena.chunk[i] = arena.chunk[i+1];
+}
+
+
+LOCAL(void)
+arena_release_oldest (j_common_ptr cinfo)
+/* Give the oldest cached chunk back to the system */
+/* cinfo may be NULL: the system-dependent free routines do not use it */
+{
+  arena_chunk oldest = arena.chunk[0];
+
+  arena_remove(0);
+  if (oldest.large)
+    jpeg_free_large(cinfo, oldest.chunk, oldest.size);
+  else
+    jpeg_free_small(cinfo, (void *) oldest.chunk, oldest.size);
+}
+
+#endif /* MEM_ARENA_SUPPORTED */
+
+
+LOCAL(void FAR *)
+get_chunk (j_common_ptr cinfo, size_t sizeofobject, boolean large)
+/* Get a chunk from the arena if it has one of this size, else from the system */
+{
+#ifdef MEM_ARENA_SUPPORTED
+  void FAR * chunk;
+  int i;
+
+  for (i = arena.count - 1; i >= 0; i--) {
+    if (arena.chunk[i].size == sizeofobject && arena.chunk[i].large == large) {
+      chunk = arena.chunk[i].chunk;
+      arena_remove(i);
+      return chunk;
+    }
+  }
+#endif
+
+  if (large)
+    return jpeg_get_large(cinfo, sizeofobject);
+  return (void FAR *) jpeg_get_small(cinfo, sizeofobject);
+}
+
+
+LOCAL(void)
+put_chunk (j_common_ptr cinfo, void FAR * chunk, size_t sizeofobject,
+	   boolean large)
+/* Release a chunk to the arena in arena mode, else to the system */
+{
+#ifdef MEM_ARENA_SUPPORTED
+  if ((long) sizeofobject <= arena.max_bytes) {
+    while (arena.count == ARENA_MAX_CHUNKS ||
+	   arena.bytes + (long) sizeofobject > arena.max_bytes)
+      arena_release_oldest(cinfo);
+    arena.chunk[arena.count].chunk = chunk;
+    arena.chunk[arena.count].size = sizeofobject;
+    arena.chunk[arena.count].large = large;
+    arena.count++;
+    arena.bytes += (long) sizeofobject;
+    return;
+  }
+#endif
+
+  if (large)
+    jpeg_free_large(cinfo, chunk, sizeofobject);
+  else
+    jpeg_free_small(cinfo, (void *) chunk, sizeofobject);
+}
+
+
 /*
  * Allocation of "small" objects.
  *
@@ -297,12 +432,12 @@ alloc_small (j_common_ptr cinfo, int pool_id, size_t sizeofobject)
       slop = (size_t) (MAX_ALLOC_CHUNK-min_request);
     /* Try to get space, if fail reduce slop and try again */
     for (;;) {
-      hdr_ptr = (small_pool_ptr) jpeg_get_small(cinfo, min_request + slop);
+      hdr_ptr = (small_pool_ptr) get_chunk(cinfo, min_request + slop, FALSE);
       if (hdr_ptr != NULL)
 	break;
       slop /= 2;
       if (slop < MIN_SLOP)	/* give up when it gets real small */
-	out_of_memory(cinfo, 2); /* jpeg_get_small failed */
+	out_of_memory(cinfo, 2); /* get_chunk failed */
     }
     mem->total_space_allocated += min_request + slop;
     /* Success, initialize the new pool header and add to end of list */
@@ -360,10 +495,10 @@ alloc_large (j_common_ptr cinfo, int pool_id, size_t sizeofobject)
   if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS)
     ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);	/* safety check */
 
-  hdr_ptr = (large_pool_ptr) jpeg_get_large(cinfo, sizeofobject +
-					    SIZEOF(large_pool_hdr));
+  hdr_ptr = (large_pool_ptr) get_chunk(cinfo, sizeofobject +
+				       SIZEOF(large_pool_hdr), TRUE);
   if (hdr_ptr == NULL)
-    out_of_memory(cinfo, 4);	/* jpeg_get_large failed */
+    out_of_memory(cinfo, 4);	/* get_chunk failed */
   mem->total_space_allocated += sizeofobject + SIZEOF(large_pool_hdr);
 
   /* Success, initialize the new pool header and add to list */
@@ -580,6 +715,137 @@ request_virt_barray (j_common_ptr cinfo, int pool_id, boolean pre_zero,
 }
 
 
+METHODDEF(jvirt_barray_ptr)
+wrap_virt_barray (j_common_ptr cinfo, int pool_id, JBLOCKARRAY rows,
+		  JDIMENSION blocksperrow, JDIMENSION numrows)
+/* Make a virtual coefficient-block array of rows the caller already holds.
+ * The array is realized at once, wholly in memory and never paged; the
+ * rows remain the caller's, only the control block belongs to the pool.
+ */
+{
+  my_mem_ptr mem = (my_mem_ptr) cinfo->mem;
+  jvirt_barray_ptr result;
+
+  /* Only IMAGE-lifetime virtual arrays are currently supported */
+  if (pool_id != JPOOL_IMAGE)
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);	/* safety check */
+
+  /* get control block */
+  result = (jvirt_barray_ptr) alloc_small(cinfo, pool_id,
+					  SIZEOF(struct jvirt_barray_control));
+
+  result->mem_buffer = rows;	/* marks array as realized */
+  result->rows_in_array = numrows;
+  result->blocksperrow = blocksperrow;
+  result->maxaccess = numrows;
+  result->rows_in_mem = numrows;
+  result->rowsperchunk = numrows;
+  result->cur_start_row = 0;
+  result->first_undef_row = numrows; /* every row is defined */
+  result->pre_zero = FALSE;
+  result->dirty = FALSE;
+  result->b_s_open = FALSE;	/* no associated backing-store object */
+  result->next = mem->virt_barray_list; /* add to list of virtual arrays */
+  mem->virt_barray_list = result;
+
+  return result;
+}
+
+
+/*
+ * Contiguous block arrays.
+ *
+ * When the application sets contiguous_barrays and all virtual arrays fit
+ * in memory, the pending block arrays are realized in one allocation, full
+ * height and one after the other in the order they were requested (for the
+ * coefficient controllers, component by component).  The coefficients of
+ * the whole image then form one flat array that the application can walk
+ * or vectorize from end to end.  An area of a huge page or more is aligned
+ * on a huge page and, where madvise() supports it, marked for transparent
+ * huge pages, which removes most TLB misses of such walks; a smaller one is
+ * aligned on a cache line.
+ *
+ * The area is owned by the memory manager rather than by JPOOL_IMAGE: it is
+ * kept when the image pool is freed, so an object that decodes a series of
+ * images of the same geometry allocates its coefficient storage only once.
+ * It is replaced when the size changes and released by self_destruct.
+ */
+
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE  (2L*1024L*1024L)
+#endif
+#define CACHE_LINE_SIZE  64L
+
+LOCAL(void)
+realize_contiguous_barrays (j_common_ptr cinfo)
+{
+  my_mem_ptr mem = (my_mem_ptr) cinfo->mem;
+  jvirt_barray_ptr bptr;
+  long total_space, offset, align;
+  char FAR * area;
+  JBLOCKROW workspace;
+  JDIMENSION row;
+  boolean fresh = FALSE;
+
+  total_space = 0;
+  for (bptr = mem->virt_barray_list; bptr != NULL; bptr = bptr->next) {
+    if (bptr->mem_buffer == NULL)
+      total_space += (long) bptr->rows_in_array *
+		     (long) bptr->blocksperrow * SIZEOF(JBLOCK);
+  }
+  align = (total_space >= HUGE_PAGE_SIZE) ? HUGE_PAGE_SIZE : CACHE_LINE_SIZE;
+  if (total_space <= 0 || mem->barray_area_busy ||
+      total_space > MAX_ALLOC_CHUNK - SIZEOF(large_pool_hdr) - align)
+    return;			/* leave it to the chunked allocation */
+
+  if (mem->barray_area != NULL &&
+      mem->barray_area_size != (size_t) (total_space + align - 1)) {
+    put_chunk(cinfo, (void FAR *) mem->barray_area, mem->barray_area_size,
+	      TRUE);
+    mem->total_space_allocated -= (long) mem->barray_area_size;
+    mem->barray_area = NULL;
+  }
+  if (mem->barray_area == NULL) {
+    mem->barray_area_size = (size_t) (total_space + align - 1);
+    mem->barray_area = (char FAR *) get_chunk(cinfo, mem->barray_area_size,
+					      TRUE);
+    if (mem->barray_area == NULL)
+      out_of_memory(cinfo, 5);	/* get_chunk failed */
+    mem->total_space_allocated += (long) mem->barray_area_size;
+    fresh = TRUE;
+  }
+  area = mem->barray_area;
+  area += (align - (long) ((size_t) area & (size_t) (align - 1))) & (align - 1);
+#if !defined(NO_MMAP) && defined(MADV_HUGEPAGE)
+  if (fresh && align == HUGE_PAGE_SIZE)
+    (void) madvise((void *) area,
+		   (size_t) (total_space & ~(HUGE_PAGE_SIZE - 1)), MADV_HUGEPAGE);
+#endif
+  mem->barray_area_busy = TRUE;
+
+  /* The list is newest first, so fill the area from its end */
+  offset = total_space;
+  for (bptr = mem->virt_barray_list; bptr != NULL; bptr = bptr->next) {
+    if (bptr->mem_buffer != NULL)
+      continue;
+    offset -= (long) bptr->rows_in_array *
+	      (long) bptr->blocksperrow * SIZEOF(JBLOCK);
+    bptr->mem_buffer = (JBLOCKARRAY) alloc_small(cinfo, JPOOL_IMAGE,
+			(size_t) (bptr->rows_in_array * SIZEOF(JBLOCKROW)));
+    workspace = (JBLOCKROW) (area + offset);
+    for (row = 0; row < bptr->rows_in_array; row++) {
+      bptr->mem_buffer[row] = workspace;
+      workspace += bptr->blocksperrow;
+    }
+    bptr->rows_in_mem = bptr->rows_in_array;
+    bptr->rowsperchunk = bptr->rows_in_array;
+    bptr->cur_start_row = 0;
+    bptr->first_undef_row = 0;
+    bptr->dirty = FALSE;
+  }
+}
+
+
 METHODDEF(void)
 realize_virt_arrays (j_common_ptr cinfo)
 /* Allocate the in-memory buffers for any unrealized virtual arrays */
@@ -606,6 +872,10 @@ realize_virt_arrays (j_common_ptr cinfo)
   }
   for (bptr = mem->virt_barray_list; bptr != NULL; bptr = bptr->next) {
     if (bptr->mem_buffer == NULL) { /* if not realized yet */
+      /* Widen the allowed accesses to the application's window */
+      if (bptr->maxaccess < mem->pub.barray_window_rows)
+	bptr->maxaccess = MIN(mem->pub.barray_window_rows,
+			      bptr->rows_in_array);
       space_per_minheight += (long) bptr->maxaccess *
 			     (long) bptr->blocksperrow * SIZEOF(JBLOCK);
       maximum_space += (long) bptr->rows_in_array *
@@ -635,6 +905,10 @@ realize_virt_arrays (j_common_ptr cinfo)
       max_minheights = 1;
   }
 
+  /* Everything fits in memory: block arrays may share one allocation */
+  if (mem->pub.contiguous_barrays && avail_mem >= maximum_space)
+    realize_contiguous_barrays(cinfo);
+
   /* Allocate the in-memory buffers and initialize backing store as needed. */
 
   for (sptr = mem->virt_sarray_list; sptr != NULL; sptr = sptr->next) {
@@ -962,6 +1236,7 @@ free_pool (j_common_ptr cinfo, int pool_id)
       }
     }
     mem->virt_barray_list = NULL;
+    mem->barray_area_busy = FALSE; /* the area itself is kept for reuse */
   }
 
   /* Release large objects */
@@ -973,7 +1248,7 @@ free_pool (j_common_ptr cinfo, int pool_id)
     space_freed = lhdr_ptr->hdr.bytes_used +
 		  lhdr_ptr->hdr.bytes_left +
 		  SIZEOF(large_pool_hdr);
-    jpeg_free_large(cinfo, (void FAR *) lhdr_ptr, space_freed);
+    put_chunk(cinfo, (void FAR *) lhdr_ptr, space_freed, TRUE);
     mem->total_space_allocated -= space_freed;
     lhdr_ptr = next_lhdr_ptr;
   }
@@ -987,7 +1262,7 @@ free_pool (j_common_ptr cinfo, int pool_id)
     space_freed = shdr_ptr->hdr.bytes_used +
 		  shdr_ptr->hdr.bytes_left +
 		  SIZEOF(small_pool_hdr);
-    jpeg_free_small(cinfo, (void *) shdr_ptr, space_freed);
+    put_chunk(cinfo, (void FAR *) shdr_ptr, space_freed, FALSE);
     mem->total_space_allocated -= space_freed;
     shdr_ptr = next_shdr_ptr;
   }
@@ -1012,8 +1287,13 @@ self_destruct (j_common_ptr cinfo)
     free_pool(cinfo, pool);
   }
 
+  /* Release the contiguous block array area, if any */
+  if (((my_mem_ptr) cinfo->mem)->barray_area != NULL)
+    put_chunk(cinfo, (void FAR *) ((my_mem_ptr) cinfo->mem)->barray_area,
+	      ((my_mem_ptr) cinfo->mem)->barray_area_size, TRUE);
+
   /* Release the memory manager control block too. */
-  jpeg_free_small(cinfo, (void *) cinfo->mem, SIZEOF(my_memory_mgr));
+  put_chunk(cinfo, (void FAR *) cinfo->mem, SIZEOF(my_memory_mgr), FALSE);
   cinfo->mem = NULL;		/* ensures I will be called only once */
 
   jpeg_mem_term(cinfo);		/* system-dependent cleanup */
@@ -1057,7 +1337,7 @@ jinit_memory_mgr (j_common_ptr cinfo)
   max_to_use = jpeg_mem_init(cinfo); /* system-dependent initialization */
 
   /* Attempt to allocate memory manager's control block */
-  mem = (my_mem_ptr) jpeg_get_small(cinfo, SIZEOF(my_memory_mgr));
+  mem = (my_mem_ptr) get_chunk(cinfo, SIZEOF(my_memory_mgr), FALSE);
 
   if (mem == NULL) {
     jpeg_mem_term(cinfo);	/* system-dependent cleanup */
@@ -1071,6 +1351,7 @@ jinit_memory_mgr (j_common_ptr cinfo)
   mem->pub.alloc_barray = alloc_barray;
   mem->pub.request_virt_sarray = request_virt_sarray;
   mem->pub.request_virt_barray = request_virt_barray;
+  mem->pub.wrap_virt_barray = wrap_virt_barray;
   mem->pub.realize_virt_arrays = realize_virt_arrays;
   mem->pub.access_virt_sarray = access_virt_sarray;
   mem->pub.access_virt_barray = access_virt_barray;
@@ -1082,6 +1363,8 @@ jinit_memory_mgr (j_common_ptr cinfo)
 
   /* Initialize working state */
   mem->pub.max_memory_to_use = max_to_use;
+  mem->pub.contiguous_barrays = FALSE;
+  mem->pub.barray_window_rows = 0;
 
   for (pool = JPOOL_NUMPOOLS-1; pool >= JPOOL_PERMANENT; pool--) {
     mem->small_list[pool] = NULL;
@@ -1089,6 +1372,9 @@ jinit_memory_mgr (j_common_ptr cinfo)
   }
   mem->virt_sarray_list = NULL;
   mem->virt_barray_list = NULL;
+  mem->barray_area = NULL;
+  mem->barray_area_size = 0;
+  mem->barray_area_busy = FALSE;
 
   mem->total_space_allocated = SIZEOF(my_memory_mgr);
 
@@ -1117,3 +1403,22 @@ jinit_memory_mgr (j_common_ptr cinfo)
 #endif
 
 }
+
+
+/*
+ * Turn arena mode on or off for the calling thread.
+ * With max_bytes > 0, the memory released by the objects this thread
+ * destroys is kept (up to max_bytes) for the next objects it creates.
+ * max_bytes = 0 gives all cached memory back and turns arena mode off;
+ * a thread should do so before it exits.
+ */
+
+GLOBAL(void)
+jpeg_mem_arena (long max_bytes)
+{
+#ifdef MEM_ARENA_SUPPORTED
+  arena.max_bytes = (max_bytes > 0 ? max_bytes : 0);
+  while (arena.bytes > arena.max_bytes)
+    arena_release_oldest((j_common_ptr) NULL);
+#endif
+}
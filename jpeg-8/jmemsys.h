@@ -160,12 +160,20 @@ typedef struct backing_store_struct {
   short temp_file;		/* file reference number to temp file */
   FSSpec tempSpec;		/* the FSSpec for the temp file */
   char temp_name[TEMP_NAME_LENGTH]; /* name if it's a file */
+#else
+#ifdef USE_MMAP_MEMMGR
+  /* For the mmap manager (jmemmap.c), we need: */
+  int temp_fd;			/* descriptor of the (unlinked) temp file */
+  void FAR * map_base;		/* address of its mapping */
+  long map_size;		/* size of the file and of the mapping */
+  char temp_name[TEMP_NAME_LENGTH]; /* name of temp file */
 #else
   /* For a typical implementation with temp files, we need: */
   FILE * temp_file;		/* stdio reference to temp file */
   char temp_name[TEMP_NAME_LENGTH]; /* name of temp file */
 #endif
 #endif
+#endif
 } backing_store_info;
 
 
@@ -113,10 +113,27 @@ struct jpeg_forward_dct {
 };
 
 /* Entropy encoding */
+typedef JMETHOD(void, locate_c_MCU_method_ptr,
+		(j_compress_ptr cinfo, JDIMENSION MCU_num,
+		 JBLOCKROW *MCU_data, JBLOCKROW workspace));
+
 struct jpeg_entropy_encoder {
   JMETHOD(void, start_pass, (j_compress_ptr cinfo, boolean gather_statistics));
   JMETHOD(boolean, encode_mcu, (j_compress_ptr cinfo, JBLOCKROW *MCU_data));
   JMETHOD(void, finish_pass, (j_compress_ptr cinfo));
+  /* Encode the num_MCUs MCUs from start_MCU (a multiple of the restart
+   * interval) into a new malloc'd buffer, to be freed by the caller: the
+   * RSTn marker preceding them (if start_MCU > 0), then their intervals, the
+   * last one flushed.  locate_MCU says where MCU number n is, and may use
+   * workspace (C_MAX_BLOCKS_IN_MCU zeroed blocks) for dummy blocks.  Leaves
+   * the encoder state untouched, so several runs of intervals may be
+   * encoded concurrently.  NULL if unsupported in the current pass.
+   */
+  JMETHOD(void, encode_intervals, (j_compress_ptr cinfo,
+				   JDIMENSION start_MCU, JDIMENSION num_MCUs,
+				   locate_c_MCU_method_ptr locate_MCU,
+				   JBLOCKROW workspace,
+				   JOCTET ** outbuffer, size_t * outsize));
 };
 
 /* Marker writing */
@@ -174,6 +191,9 @@ struct jpeg_d_coef_controller {
 				 JSAMPIMAGE output_buf));
   /* Pointer to array of coefficient virtual arrays, or NULL if none */
   jvirt_barray_ptr *coef_arrays;
+  /* TRUE while the input is consumed a row at a time by
+   * jpeg_consume_coefficients: a scan must then not be decoded at once */
+  boolean incremental;
 };
 
 /* Decompression postprocessing (color quantization buffer control) */
@@ -209,10 +229,23 @@ struct jpeg_marker_reader {
 };
 
 /* Entropy decoding */
+typedef JMETHOD(void, locate_MCU_method_ptr,
+		(j_decompress_ptr cinfo, JDIMENSION MCU_num,
+		 JBLOCKROW *MCU_data));
+
 struct jpeg_entropy_decoder {
   JMETHOD(void, start_pass, (j_decompress_ptr cinfo));
   JMETHOD(boolean, decode_mcu, (j_decompress_ptr cinfo,
 				JBLOCKROW *MCU_data));
+  /* Decode the num_MCUs MCUs of one restart interval from the given bytes
+   * (ending with the marker that terminates the interval), placing MCU
+   * number n where locate_MCU says.  Leaves the decoder state untouched,
+   * so several intervals may be decoded concurrently.  NULL if unsupported.
+   */
+  JMETHOD(boolean, decode_interval, (j_decompress_ptr cinfo,
+				     const JOCTET * data, size_t datalen,
+				     JDIMENSION start_MCU, JDIMENSION num_MCUs,
+				     locate_MCU_method_ptr locate_MCU));
 };
 
 /* Inverse DCT (also performs dequantization) */
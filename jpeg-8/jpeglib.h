@@ -210,6 +210,14 @@ struct jpeg_marker_struct {
   /* the marker length word is not counted in data_length or original_length */
 };
 
+/* Totals over the real blocks of all components, from jpeg_count_coefficients: */
+
+typedef struct {
+  long num_blocks;		/* number of DCT blocks (64 coefficients each) */
+  long nonzero_dc;		/* blocks whose DC coefficient is nonzero */
+  long nonzero_ac;		/* nonzero AC coefficients */
+} jpeg_coef_counts;
+
 /* Known color spaces. */
 
 typedef enum {
@@ -355,6 +363,7 @@ struct jpeg_compress_struct {
    */
   unsigned int restart_interval; /* MCUs per restart, or 0 for no restart */
   int restart_in_rows;		/* if > 0, MCU rows per restart interval */
+  int restart_threads;		/* threads encoding the intervals, 0 = auto */
 
   /* Parameters controlling emission of special markers. */
 
@@ -481,6 +490,8 @@ struct jpeg_decompress_struct {
   boolean enable_external_quant;/* enable future use of external colormap */
   boolean enable_2pass_quant;	/* enable future use of 2-pass quantizer */
 
+  int restart_threads;		/* threads decoding restart intervals, 0 = auto */
+
   /* Description of actual output image that will be returned to application.
    * These fields are computed by jpeg_start_decompress().
    * You can also use jpeg_calc_output_dimensions() to determine these values
@@ -816,6 +827,11 @@ struct jpeg_memory_mgr {
 						  JDIMENSION blocksperrow,
 						  JDIMENSION numrows,
 						  JDIMENSION maxaccess));
+  JMETHOD(jvirt_barray_ptr, wrap_virt_barray, (j_common_ptr cinfo,
+					       int pool_id,
+					       JBLOCKARRAY rows,
+					       JDIMENSION blocksperrow,
+					       JDIMENSION numrows));
   JMETHOD(void, realize_virt_arrays, (j_common_ptr cinfo));
   JMETHOD(JSAMPARRAY, access_virt_sarray, (j_common_ptr cinfo,
 					   jvirt_sarray_ptr ptr,
@@ -839,6 +855,20 @@ struct jpeg_memory_mgr {
 
   /* Maximum allocation request accepted by alloc_large. */
   long max_alloc_chunk;
+
+  /* If TRUE, block arrays that fit in memory are realized in a single
+   * aligned allocation, one after the other in request order.  May be set
+   * by outer application before the virtual arrays are realized.
+   */
+  boolean contiguous_barrays;
+
+  /* If nonzero, block arrays are realized so that this many rows can be
+   * accessed at once, even if their requester asked for fewer: the outer
+   * application can then walk them in bands of its own height, paged
+   * through backing store when they do not fit in max_memory_to_use.
+   * May be set before the virtual arrays are realized.
+   */
+  JDIMENSION barray_window_rows;
 };
 
 
@@ -873,10 +903,13 @@ typedef JMETHOD(boolean, jpeg_marker_parser_method, (j_decompress_ptr cinfo));
 #define jpeg_CreateDecompress	jCreaDecompress
 #define jpeg_destroy_compress	jDestCompress
 #define jpeg_destroy_decompress	jDestDecompress
+#define jpeg_mem_arena		jMemArena
 #define jpeg_stdio_dest		jStdDest
 #define jpeg_stdio_src		jStdSrc
+#define jpeg_mmap_src		jMmapSrc
 #define jpeg_mem_dest		jMemDest
 #define jpeg_mem_src		jMemSrc
+#define jpeg_grow_dest		jGrowDest
 #define jpeg_set_defaults	jSetDefaults
 #define jpeg_set_colorspace	jSetColorspace
 #define jpeg_default_colorspace	jDefColorspace
@@ -889,6 +922,7 @@ typedef JMETHOD(boolean, jpeg_marker_parser_method, (j_decompress_ptr cinfo));
 #define jpeg_suppress_tables	jSuppressTables
 #define jpeg_alloc_quant_table	jAlcQTable
 #define jpeg_alloc_huff_table	jAlcHTable
+#define jpeg_gen_optimal_table	jGenOptTable
 #define jpeg_start_compress	jStrtCompress
 #define jpeg_write_scanlines	jWrtScanlines
 #define jpeg_finish_compress	jFinCompress
@@ -914,6 +948,9 @@ typedef JMETHOD(boolean, jpeg_marker_parser_method, (j_decompress_ptr cinfo));
 #define jpeg_save_markers	jSaveMarkers
 #define jpeg_set_marker_processor	jSetMarker
 #define jpeg_read_coefficients	jReadCoefs
+#define jpeg_start_coefficients	jStrtCoefs
+#define jpeg_consume_coefficients	jConsumeCoefs
+#define jpeg_count_coefficients	jCountCoefs
 #define jpeg_write_coefficients	jWrtCoefs
 #define jpeg_copy_critical_parameters	jCopyCrit
 #define jpeg_abort_compress	jAbrtCompress
@@ -948,11 +985,15 @@ EXTERN(void) jpeg_CreateDecompress JPP((j_decompress_ptr cinfo,
 /* Destruction of JPEG compression objects */
 EXTERN(void) jpeg_destroy_compress JPP((j_compress_ptr cinfo));
 EXTERN(void) jpeg_destroy_decompress JPP((j_decompress_ptr cinfo));
+/* Per-thread reuse of the memory of destroyed objects (see jmemmgr.c) */
+EXTERN(void) jpeg_mem_arena JPP((long max_bytes));
 
 /* Standard data source and destination managers: stdio streams. */
 /* Caller is responsible for opening the file before and closing after. */
 EXTERN(void) jpeg_stdio_dest JPP((j_compress_ptr cinfo, FILE * outfile));
 EXTERN(void) jpeg_stdio_src JPP((j_decompress_ptr cinfo, FILE * infile));
+/* Same input, but the whole file is memory-mapped (see jdatasrc.c). */
+EXTERN(void) jpeg_mmap_src JPP((j_decompress_ptr cinfo, FILE * infile));
 
 /* Data source and destination managers: memory buffers. */
 EXTERN(void) jpeg_mem_dest JPP((j_compress_ptr cinfo,
@@ -961,6 +1002,11 @@ EXTERN(void) jpeg_mem_dest JPP((j_compress_ptr cinfo,
 EXTERN(void) jpeg_mem_src JPP((j_decompress_ptr cinfo,
 			      unsigned char * inbuffer,
 			      unsigned long insize));
+/* Single growable buffer, written to outfile at once or handed over. */
+EXTERN(void) jpeg_grow_dest JPP((j_compress_ptr cinfo, FILE * outfile,
+				unsigned char ** outbuffer,
+				unsigned long * outsize,
+				unsigned long size_hint));
 
 /* Default parameter setup for compression */
 EXTERN(void) jpeg_set_defaults JPP((j_compress_ptr cinfo));
@@ -985,6 +1031,11 @@ EXTERN(void) jpeg_suppress_tables JPP((j_compress_ptr cinfo,
 				       boolean suppress));
 EXTERN(JQUANT_TBL *) jpeg_alloc_quant_table JPP((j_common_ptr cinfo));
 EXTERN(JHUFF_TBL *) jpeg_alloc_huff_table JPP((j_common_ptr cinfo));
+/* Optimal Huffman table for symbol counts gathered by the application
+ * (freq[] has 257 entries and is clobbered).
+ */
+EXTERN(void) jpeg_gen_optimal_table JPP((j_compress_ptr cinfo,
+					 JHUFF_TBL * htbl, long freq[]));
 
 /* Main entry points for compression */
 EXTERN(void) jpeg_start_compress JPP((j_compress_ptr cinfo,
@@ -1071,6 +1122,12 @@ EXTERN(void) jpeg_set_marker_processor
 
 /* Read or write raw DCT coefficients --- useful for lossless transcoding. */
 EXTERN(jvirt_barray_ptr *) jpeg_read_coefficients JPP((j_decompress_ptr cinfo));
+/* Incremental variant: set up the arrays, then absorb one iMCU row a call. */
+EXTERN(jvirt_barray_ptr *) jpeg_start_coefficients JPP((j_decompress_ptr cinfo));
+EXTERN(int) jpeg_consume_coefficients JPP((j_decompress_ptr cinfo));
+/* Count the nonzero coefficients of a sequential file without storing them. */
+EXTERN(boolean) jpeg_count_coefficients JPP((j_decompress_ptr cinfo,
+					     jpeg_coef_counts * counts));
 EXTERN(void) jpeg_write_coefficients JPP((j_compress_ptr cinfo,
 					  jvirt_barray_ptr * coef_arrays));
 EXTERN(void) jpeg_copy_critical_parameters JPP((j_decompress_ptr srcinfo,
@@ -1,11 +1,148 @@
 ﻿#include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "error.h"
 #include "jpeg_manip.h"
 
 
+/* Fill the addressing table of img from its component geometry.
+ * For each component we keep the index of its first block and a fixed point
+ * reciprocal of its width: with shift = 32 + ceil(log2(width)), the product
+ * blk * recip >> shift equals blk / width for every block index of a JPEG
+ * component (less than 2^27), so getDCTcoeffPtr() needs no division. */
+static void build_dct_addr (JPEGimg *img)
+{
+	DCTaddr *addr = &img->addr;
+	jpeg_component_info *compptr;
+	int comp, width, log2w, nbBlocks = 0;
+
+	for (comp = 0; comp < MAX_COMPONENTS; comp++)
+	{
+		if (comp >= img->cinfo->num_components)
+		{
+			addr->compStart[comp] = INT_MAX;
+			addr->width[comp] = 1;
+			addr->recip[comp] = 1ULL << 32;
+			addr->shift[comp] = 32;
+			continue;
+		}
+		compptr = &img->cinfo->comp_info[comp];
+		width = compptr->width_in_blocks;
+		for (log2w = 0; (1 << log2w) < width; log2w++)
+			;
+		addr->compStart[comp] = nbBlocks;
+		addr->width[comp] = width;
+		addr->shift[comp] = 32 + log2w;
+		addr->recip[comp] = ((1ULL << addr->shift[comp]) + width - 1) / width;
+		nbBlocks += width * compptr->height_in_blocks;
+	}
+	addr->nbCoeffs = nbBlocks * DCTSIZE2;
+}
+
+
+/* Position in the block of the k-th coefficient in zigzag order, the order
+ * in which the Huffman encoder codes the AC coefficients */
+static const int zigzag[DCTSIZE2] = {
+	 0,  1,  8, 16,  9,  2,  3, 10,
+	17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34,
+	27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36,
+	29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46,
+	53, 60, 61, 54, 47, 55, 62, 63
+};
+
+
+/* Number of bits of the magnitude of a coefficient (its Huffman category) */
+static inline int huff_nbits (int value)
+{
+	unsigned int mag = (unsigned int) (value < 0 ? -value : value);
+
+	return mag ? 32 - __builtin_clz (mag) : 0;
+}
+
+
+/* Count the AC symbols of a block as the sequential Huffman encoder emits
+ * them: a ZRL (0xF0) per run of 16 zeros, run << 4 | category for each
+ * nonzero coefficient, and an EOB (0) if the block ends with zeros */
+static void count_ac_symbols (const JCOEF *block, long *freq)
+{
+	int k, run = 0;
+
+	for (k = 1; k < DCTSIZE2; k++)
+	{
+		if (block[zigzag[k]] == 0)
+		{
+			run++;
+			continue;
+		}
+		for (; run > 15; run -= 16)
+			freq[0xF0]++;
+		freq[(run << 4) + huff_nbits (block[zigzag[k]])]++;
+		run = 0;
+	}
+	if (run > 0)
+		freq[0]++;
+}
+
+
+/* Clear the Huffman statistics of img, allocating them on first use.
+ * Returns NULL if they cannot be allocated */
+static HuffStats *huff_stats_reset (JPEGimg *img)
+{
+	HuffStats *stats = img->huffStats;
+
+	if (!stats)
+	{
+		if ((stats = (HuffStats*) malloc (sizeof(HuffStats))) == NULL
+		    || (stats->dc = (JCOEF*) malloc (img->addr.nbCoeffs / DCTSIZE2 * sizeof(JCOEF))) == NULL)
+		{
+			print_err ("jpeg_flat_sync()", "img->huffStats", ERR_MEM);
+			free (stats);
+			return NULL;
+		}
+		img->huffStats = stats;
+	}
+	memset (stats->ac, 0, sizeof(stats->ac));
+
+	return stats;
+}
+
+
+/* Fatal libjpeg error: the message is printed, then control goes back to the
+ * jpeg_manip function that armed the error manager. Unarmed, the program
+ * ends as with the error_exit of jpeg_std_error */
+static void trap_error_exit (j_common_ptr cinfo)
+{
+	JPEGerror *err = (JPEGerror*) cinfo->err;
+
+	(*cinfo->err->output_message) (cinfo);
+	if (!err->armed)
+	{
+		jpeg_destroy (cinfo);
+		exit (EXIT_FAILURE);
+	}
+	err->armed = 0;
+	longjmp (err->env, 1);
+}
+
+
+/* jpeg_std_error, with fatal errors returning through err->env once armed */
+static struct jpeg_error_mgr *trap_error (JPEGerror *err)
+{
+	jpeg_std_error (&err->pub);
+	err->pub.error_exit = trap_error_exit;
+	err->armed = 0;
+	return &err->pub;
+}
+
+
 JPEGimg *init_jpeg_img ( void )
 {
 	JPEGimg * img = NULL;
@@ -21,16 +158,46 @@ JPEGimg *init_jpeg_img ( void )
 		free(img);
 		return NULL;
 	}
+
+	img->optimizeCoding = JPEG_HUFF_STATS;
 	
 	return img;
 }
 
 
+/* End the reading of an image opened by jpeg_read_partial: release the
+ * source (this unmaps the file) and close the file */
+static void end_partial (JPEGimg *img)
+{
+	if (img->partialFile)
+	{
+		(*img->cinfo->src->term_source) (img->cinfo);
+		fclose (img->partialFile);
+		img->partialFile = NULL;
+	}
+}
+
+
+/* Unmap the cache file of an image read by jpeg_read_cache. Its coefficient
+ * rows and flat view pointed into the mapping */
+static void end_cache (JPEGimg *img)
+{
+	if (img->cacheMap)
+	{
+		munmap (img->cacheMap, img->cacheSize);
+		img->cacheMap = NULL;
+		img->cacheSize = 0;
+		img->flatCoeffs = NULL;
+	}
+}
+
+
 int free_jpeg_img ( JPEGimg *img )
 {
 	// Checkargs
 	if (!img)
 		return ERR_ARG;
+	end_partial (img);
 	
 	// Free memory
 	if (img->dctCoeffs)
@@ -38,8 +205,23 @@ int free_jpeg_img ( JPEGimg *img )
 		free (img->dctCoeffs);
 		img->dctCoeffs = NULL;
 	}
+	if (img->flatAlloc)
+	{
+		free (img->flatAlloc);
+		free (img->flatRows);
+		img->flatAlloc = NULL;
+		img->flatRows = NULL;
+		img->flatCoeffs = NULL;
+	}
+	if (img->huffStats)
+	{
+		free (img->huffStats->dc);
+		free (img->huffStats);
+		img->huffStats = NULL;
+	}
 	
 	jpeg_destroy_decompress(img->cinfo);
+	end_cache (img);
 
 	if (img->cinfo)
 	{
@@ -52,24 +234,265 @@ int free_jpeg_img ( JPEGimg *img )
 }
 
 
-JPEGimg *jpeg_read (char *path)
+/* Read the header from the source set on img->cinfo, set up the coefficient
+ * arrays and fill the direct access arrays, without decoding anything yet.
+ * img is kept on error */
+static int start_coeffs (JPEGimg *img)
 {
 	int comp;
-	struct jpeg_error_mgr jerr; // Handle errors
+
+	// Read header
+	(void) jpeg_read_header (img->cinfo, TRUE);
+	img->cinfo->restart_threads = img->restartThreads;
+
+	// All the coefficients in one allocation, which can serve as the flat view
+	img->cinfo->mem->contiguous_barrays = TRUE;
+  
+	/* Get DCT coefficients
+	 * dct_coeffs is a virtual array of the components Y, Cb, Cr
+	 * access to the physical array with the function
+	 * (cinfo->mem -> access_virt_barray)*/
+	img->virtCoeffs = jpeg_start_coefficients (img->cinfo);
+	
+	// Structure allocation, for any number of components so that it is reused
+	if (!img->dctCoeffs
+	    && (img->dctCoeffs = (JBLOCKARRAY*) malloc (sizeof(JBLOCKARRAY) * MAX_COMPONENTS)) == NULL)
+	{
+		print_err ("jpeg_read()", "img->dctCoeffs", ERR_MEM);
+		return ERR_MEM;
+	}
+  
+	// Loop on the components of the virtual array to get DCT coefficients
+	for(comp = 0; comp < img->cinfo->num_components; comp++)
+	{
+  		img->dctCoeffs[comp] = (img->cinfo->mem -> access_virt_barray)((j_common_ptr) img->cinfo,
+		img->virtCoeffs[comp], 0, 1, TRUE);
+	}
+
+	// Precompute the coefficient addressing table
+	build_dct_addr (img);
+
+	img->decodedCoeffs = 0;
+	memset (img->decodedRows, 0, sizeof(img->decodedRows));
+
+	return EXIT_SUCCESS;
+}
+
+
+/* Read the header and the DCT coefficients from the source set on img->cinfo,
+ * then fill the direct access arrays. img is kept on error */
+static int load_coeffs (JPEGimg *img)
+{
+	int ret;
+
+	if ((ret = start_coeffs (img)) != EXIT_SUCCESS)
+		return ret;
+
+	// Absorb the whole file into the arrays set up by start_coeffs
+	(void) jpeg_read_coefficients (img->cinfo);
+	img->decodedCoeffs = img->addr.nbCoeffs;
+
+	/* All compressed data has been consumed: release the source now (this
+	 * unmaps the file with jpeg_mmap_src), jpeg_finish_decompress is never
+	 * called since it would free the coefficients */
+	(*img->cinfo->src->term_source) (img->cinfo);
+
+	return EXIT_SUCCESS;
+}
+
+
+/* load_coeffs for a new JPEGimg, which is freed on error, including a fatal
+ * libjpeg error (corrupt or truncated file) */
+static JPEGimg *read_coeffs (JPEGimg *img)
+{
+	if (setjmp (img->jerr.env))
+	{
+		(*img->cinfo->src->term_source) (img->cinfo);
+		free_jpeg_img (img);
+		return NULL;
+	}
+	img->jerr.armed = 1;
+
+	if (load_coeffs (img) != EXIT_SUCCESS)
+	{
+		free_jpeg_img (img);
+		return NULL;
+	}
+	img->jerr.armed = 0;
+	return img;
+}
+
+
+/* True if the flat view and statistics sized for the geometry old still fit
+ * the one of new (same components, same blocks per row and per component) */
+static int same_geometry (const DCTaddr *old, const DCTaddr *new)
+{
+	return old->nbCoeffs == new->nbCoeffs
+	    && !memcmp (old->compStart, new->compStart, sizeof(old->compStart))
+	    && !memcmp (old->width, new->width, sizeof(old->width));
+}
+
+
+/* Expected size of the written image: the size of the cover plus a margin,
+ * since the default Huffman tables may code it less tightly than the
+ * cover's; about 2 bits per coefficient if the cover size is unknown */
+static unsigned long output_size_hint (JPEGimg *img)
+{
+	if (img->srcSize)
+		return img->srcSize + img->srcSize / 8 + 4096;
+	return (unsigned long) img->addr.nbCoeffs / 4 + 4096;
+}
+
+
+/* Fill the Huffman table *htblptr of cinfo from the symbol counts freq */
+static void set_huff_table (j_compress_ptr cinfo, JHUFF_TBL **htblptr, long freq[])
+{
+	if (*htblptr == NULL)
+		*htblptr = jpeg_alloc_huff_table ((j_common_ptr) cinfo);
+	jpeg_gen_optimal_table (cinfo, *htblptr, freq);
+}
+
+
+/* Set optimal Huffman tables on cinfo from the statistics of img: the AC
+ * symbols counted by jpeg_flat_sync, and the DC differences counted here in
+ * coding order. The image is written as one scan, interleaved if it has
+ * several components: each MCU holds h x v blocks of each component, coded
+ * row by row, and the blocks padding the MCUs past the right and bottom
+ * edges repeat the previous DC (symbol 0) and only have an EOB. The DC
+ * predictors restart from 0 at each restart interval */
+static void set_optimal_tables (JPEGimg *img, j_compress_ptr cinfo)
+{
+	const HuffStats *stats = img->huffStats;
+	jpeg_component_info *compptr;
+	long dc[MAX_COMPONENTS][17], dummies[MAX_COMPONENTS], freq[257];
+	int last[MAX_COMPONENTS], h[MAX_COMPONENTS], v[MAX_COMPONENTS];
+	int nbComps = img->cinfo->num_components, mcuCols, mcuRows;
+	int comp, tbl, used, x, y, lin, col, value, s;
+	unsigned int mcuRow, mcuCol, n = 0;
+
+	memset (dc, 0, sizeof(dc));
+	memset (dummies, 0, sizeof(dummies));
+	for (comp = 0; comp < nbComps; comp++)
+	{
+		compptr = &img->cinfo->comp_info[comp];
+		h[comp] = nbComps > 1 ? compptr->h_samp_factor : 1;
+		v[comp] = nbComps > 1 ? compptr->v_samp_factor : 1;
+	}
+	compptr = &img->cinfo->comp_info[0];
+	mcuCols = (compptr->width_in_blocks + h[0] - 1) / h[0];
+	mcuRows = (compptr->height_in_blocks + v[0] - 1) / v[0];
+
+	// DC differences, MCU by MCU
+	for (mcuRow = 0; mcuRow < (unsigned int) mcuRows; mcuRow++)
+		for (mcuCol = 0; mcuCol < (unsigned int) mcuCols; mcuCol++, n++)
+		{
+			if (img->restartInterval ? n % img->restartInterval == 0 : n == 0)
+				memset (last, 0, sizeof(last));
+			for (comp = 0; comp < nbComps; comp++)
+			{
+				compptr = &img->cinfo->comp_info[comp];
+				for (y = 0; y < v[comp]; y++)
+					for (x = 0; x < h[comp]; x++)
+					{
+						lin = mcuRow * v[comp] + y;
+						col = mcuCol * h[comp] + x;
+						if (lin >= (int) compptr->height_in_blocks || col >= (int) compptr->width_in_blocks)
+						{
+							dummies[comp]++;
+							continue;
+						}
+						value = stats->dc[img->addr.compStart[comp] + lin * (int) compptr->width_in_blocks + col];
+						dc[comp][huff_nbits (value - last[comp])]++;
+						last[comp] = value;
+					}
+			}
+		}
+
+	// One DC and one AC table per table number, from the components using it
+	for (tbl = 0; tbl < NUM_HUFF_TBLS; tbl++)
+	{
+		memset (freq, 0, sizeof(freq));
+		for (used = 0, comp = 0; comp < nbComps; comp++)
+			if (cinfo->comp_info[comp].dc_tbl_no == tbl)
+			{
+				for (s = 0; s < 17; s++)
+					freq[s] += dc[comp][s];
+				freq[0] += dummies[comp];
+				used = 1;
+			}
+		if (used)
+			set_huff_table (cinfo, &cinfo->dc_huff_tbl_ptrs[tbl], freq);
+
+		memset (freq, 0, sizeof(freq));
+		for (used = 0, comp = 0; comp < nbComps; comp++)
+			if (cinfo->comp_info[comp].ac_tbl_no == tbl)
+			{
+				for (s = 0; s < 256; s++)
+					freq[s] += stats->ac[comp][s];
+				freq[0] += dummies[comp];
+				used = 1;
+			}
+		if (used)
+			set_huff_table (cinfo, &cinfo->ac_huff_tbl_ptrs[tbl], freq);
+	}
+}
+
+
+/* Write the coefficients of img through the destination set on cinfo */
+static void write_coeffs (JPEGimg *img, j_compress_ptr cinfo)
+{
+	// Flush the flat view (if any) into the virtual arrays, counting the Huffman symbols
+	if (img->flatCoeffs)
+		jpeg_flat_sync (img);
+
+	// Applying parameters from source jpeg 
+	jpeg_copy_critical_parameters(img->cinfo, cinfo);
+
+	// Restart markers let the library encode the intervals on several threads
+	cinfo->restart_interval = img->restartInterval;
+	cinfo->restart_threads = img->restartThreads;
+
+	/* Optimal Huffman tables: built from the statistics of the flat view,
+	 * optimize_coding stays off and the library skips its gathering pass.
+	 * Without them, the library counts the symbols itself only if asked to:
+	 * that pass reads all the coefficients a second time */
+	if (img->optimizeCoding != JPEG_HUFF_STD && img->flatCoeffs && img->huffStats)
+		set_optimal_tables (img, cinfo);
+	else if (img->optimizeCoding == JPEG_HUFF_OPTIMIZE)
+		cinfo->optimize_coding = TRUE;
+
+	// copying DCT 
+	jpeg_write_coefficients(cinfo, img->virtCoeffs);
+
+	// clean-up
+	jpeg_finish_compress(cinfo);
+	jpeg_destroy_compress(cinfo);
+}
+
+
+JPEGimg *jpeg_read (char *path)
+{
+	return jpeg_read_src (path, JPEG_SRC_MMAP);
+}
+
+
+JPEGimg *jpeg_read_src (char *path, int src)
+{
 	FILE *infile = NULL;
 	JPEGimg *img = NULL;
+	long size;
 	
 	// Check args
-	if (!path)
+	if (!path || (src != JPEG_SRC_STDIO && src != JPEG_SRC_MMAP))
 	{
-		print_err ("jpeg_read()", "path", ERR_ARG);
+		print_err ("jpeg_read_src()", "path", ERR_ARG);
 		return NULL;
 	}
 	
 	// Open path
 	if ((infile = fopen(path, "rb") ) == NULL)
 	{
-		print_err ("jpeg_read()", path, ERR_FOPEN);
+		print_err ("jpeg_read_src()", path, ERR_FOPEN);
 		return NULL;
 	}
 	
@@ -81,113 +504,1128 @@ JPEGimg *jpeg_read (char *path)
 	}
 	
 	// Initialize the JPEG decompression object with default error handling.
-	img->cinfo->err = jpeg_std_error (&jerr);
+	img->cinfo->err = trap_error (&img->jerr);
 	jpeg_create_decompress (img->cinfo);
   
+	// Size of the cover, used to preallocate the output when writing
+	if (fseek (infile, 0, SEEK_END) == 0 && (size = ftell (infile)) > 0)
+		img->srcSize = (unsigned long) size;
+	rewind (infile);
+
 	// Specify data source for decompression
-	jpeg_stdio_src (img->cinfo, infile);
-  
-	// Read header
-	(void) jpeg_read_header (img->cinfo, TRUE);
-  
-	/* Get DCT coefficients
-	 * dct_coeffs is a virtual array of the components Y, Cb, Cr
-	 * access to the physical array with the function
-	 * (cinfo->mem -> access_virt_barray)*/
-	img->virtCoeffs = jpeg_read_coefficients (img->cinfo);
-	
-	// Structure allocation
-	img->dctCoeffs = (JBLOCKARRAY*) malloc (sizeof(JBLOCKARRAY) * img->cinfo->num_components );
-	if (img->dctCoeffs == NULL)
-	{
-		print_err ("jpeg_read()", "img->dctCoeffs", ERR_MEM);
-		fclose (infile);
-		return NULL;
-	}
+	if (src == JPEG_SRC_MMAP)
+		jpeg_mmap_src (img->cinfo, infile);
+	else
+		jpeg_stdio_src (img->cinfo, infile);
   
-	// Loop on the components of the virtual array to get DCT coefficients
-	for(comp = 0; comp < img->cinfo->num_components; comp++)
-	{
-  		img->dctCoeffs[comp] = (img->cinfo->mem -> access_virt_barray)((j_common_ptr) &(img->cinfo),
-		img->virtCoeffs[comp], 0, 1, TRUE);
-	}
+	img = read_coeffs (img);
   
 	// free and close
 	fclose (infile);
+	if (!img)
+		print_err ("jpeg_read_src()", path, ERR_FREAD);
                         
 	return img;
 }
 
 
-int jpeg_write_from_coeffs (char *outfile, JPEGimg *img)
+int jpeg_read_into (JPEGimg *img, char *path)
 {
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	FILE *output = NULL;
+	FILE *infile = NULL;
+	DCTaddr prevAddr;
+	long size;
+	int ret;
 
-	// Open file
-	if ((output = fopen (outfile, "wb")) == NULL)
+	// Check args
+	if (!img || !img->cinfo || !path || img->windowRows)
 	{
-		print_err( "jpeg_write_from_coeffs()", outfile, ERR_FOPEN);
+		print_err ("jpeg_read_into()", "img", ERR_ARG);
+		return ERR_ARG;
+	}
+
+	// Open path
+	if ((infile = fopen(path, "rb") ) == NULL)
+	{
+		print_err ("jpeg_read_into()", path, ERR_FOPEN);
 		return ERR_FOPEN;
 	}
-	
-	// Initialize the JPEG compression object with default error handling. 
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-	
-	// telling where to put jpeg data
-	jpeg_stdio_dest(&cinfo, output);
 
-	// Applying parameters from source jpeg 
-	jpeg_copy_critical_parameters(img->cinfo, &cinfo);
+	/* The decompression object is created for the first image only; for the
+	 * next ones jpeg_abort_decompress frees the previous image but keeps the
+	 * object, its tables and the coefficient area of the memory manager */
+	if (img->cinfo->mem == NULL)
+	{
+		img->cinfo->err = trap_error (&img->jerr);
+		jpeg_create_decompress (img->cinfo);
+	}
+	else
+	{
+		end_partial (img);
+		jpeg_abort_decompress (img->cinfo);
+		end_cache (img);
+	}
+	prevAddr = img->addr;
 
-	// copying DCT 
-	jpeg_write_coefficients(&cinfo, img->virtCoeffs);
+	/* A fatal libjpeg error (corrupt or truncated cover) only fails this
+	 * image: the object is aborted and kept for the next one, whose flat
+	 * view is then rebuilt from scratch */
+	if (setjmp (img->jerr.env))
+	{
+		if (img->cinfo->src)
+			(*img->cinfo->src->term_source) (img->cinfo);
+		jpeg_abort_decompress (img->cinfo);
+		fclose (infile);
+		memset (&img->addr, 0, sizeof(img->addr));
+		img->flatCoeffs = NULL;
+		img->decodedCoeffs = 0;
+		print_err ("jpeg_read_into()", path, ERR_FREAD);
+		return ERR_FREAD;
+	}
+	img->jerr.armed = 1;
+
+	// Size of the cover, used to preallocate the output when writing
+	img->srcSize = 0;
+	if (fseek (infile, 0, SEEK_END) == 0 && (size = ftell (infile)) > 0)
+		img->srcSize = (unsigned long) size;
+	rewind (infile);
+
+	jpeg_mmap_src (img->cinfo, infile);
+	ret = load_coeffs (img);
+	img->jerr.armed = 0;
+	fclose (infile);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	// The flat view is rebuilt on demand, in the same buffers if they still fit
+	img->flatCoeffs = NULL;
+	if (!same_geometry (&prevAddr, &img->addr))
+	{
+		free (img->flatAlloc);
+		free (img->flatRows);
+		img->flatAlloc = NULL;
+		img->flatRows = NULL;
+		if (img->huffStats)
+		{
+			free (img->huffStats->dc);
+			free (img->huffStats);
+			img->huffStats = NULL;
+		}
+	}
 
-	// clean-up
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
-	fclose (output);
-	
-	/*Done!*/
 	return EXIT_SUCCESS;
 }
 
 
-int getDCTpos (JPEGimg *img, int pos, DCTpos * const position)
+JPEGimg *jpeg_read_partial (char *path)
 {
-	int nbDCTblocks = 0; // Number of DCT coefficients into a component
-	sjdec* cinfo;
+	FILE *infile = NULL;
+	JPEGimg *img = NULL;
+	long size;
 
-	// Check arguments
-	if (!img || !position)
+	// Check args
+	if (!path)
 	{
-		print_err("getDCTpos()", "img, cinfo or position", ERR_ARG);
-		return ERR_ARG;
+		print_err ("jpeg_read_partial()", "path", ERR_ARG);
+		return NULL;
 	}
 
-	cinfo = img->cinfo;
-	// reset position
-	memset(position, 0, sizeof(DCTpos));
+	// Open path
+	if ((infile = fopen(path, "rb") ) == NULL)
+	{
+		print_err ("jpeg_read_partial()", path, ERR_FOPEN);
+		return NULL;
+	}
 
-	// Find position in DCT block position
-	position->coeff = pos & 63; // equivalent to pos % 64
-	pos >>= 6;                  // equivalent to pos / 64
-	
-	// Find component
-	while (position->comp < cinfo->num_components)
+	// Memory allocation for img
+	if ((img = init_jpeg_img()) == NULL)
+	{
+		fclose (infile);
+		return NULL;
+	}
+
+	// Initialize the JPEG decompression object with default error handling.
+	img->cinfo->err = trap_error (&img->jerr);
+	jpeg_create_decompress (img->cinfo);
+
+	// Size of the cover, used to preallocate the output when writing
+	if (fseek (infile, 0, SEEK_END) == 0 && (size = ftell (infile)) > 0)
+		img->srcSize = (unsigned long) size;
+	rewind (infile);
+
+	/* The file stays open until the image is decoded (the stdio fallback of
+	 * jpeg_mmap_src reads it as decoding goes) */
+	jpeg_mmap_src (img->cinfo, infile);
+	img->partialFile = infile;
+
+	if (start_coeffs (img) != EXIT_SUCCESS)
+	{
+		free_jpeg_img (img);
+		return NULL;
+	}
+	return img;
+}
+
+
+/* Number of leading coefficients of img, in the order of getDCTpos, whose
+ * block rows are all decoded */
+static int decoded_prefix (JPEGimg *img)
+{
+	jpeg_component_info *compptr;
+	int comp, nbCoeffs = 0;
+
+	for (comp = 0; comp < img->cinfo->num_components; comp++)
 	{
-		nbDCTblocks = cinfo->comp_info[position->comp].height_in_blocks * cinfo->comp_info[position->comp].width_in_blocks;
-		if (pos < nbDCTblocks)
+		compptr = &img->cinfo->comp_info[comp];
+		nbCoeffs += img->decodedRows[comp] * compptr->width_in_blocks * DCTSIZE2;
+		if (img->decodedRows[comp] < (int) compptr->height_in_blocks)
 			break;
-		position->comp++;
-		pos -= nbDCTblocks;
 	}
+	return nbCoeffs;
+}
+
+
+int jpeg_decode_until (JPEGimg *img, int nbCoeffs)
+{
+	sjdec *cinfo;
+	jpeg_component_info *compptr;
+	int ci, rows, ret;
+
+	// Check arguments
+	if (!img || !img->dctCoeffs)
+	{
+		print_err ("jpeg_decode_until()", "img", ERR_ARG);
+		return ERR_ARG;
+	}
+	cinfo = img->cinfo;
+
+	/* One iMCU row at a time. In sequential mode every component is coded in
+	 * a single scan, so the rows the current scan has passed are final */
+	while (img->decodedCoeffs < nbCoeffs && img->decodedCoeffs < img->addr.nbCoeffs)
+	{
+		ret = jpeg_consume_coefficients (cinfo);
+		if (ret == JPEG_SUSPENDED)
+		{
+			print_err ("jpeg_decode_until()", "img->cinfo->src", ERR_FREAD);
+			return ERR_FREAD;
+		}
+		if (ret == JPEG_REACHED_EOI)
+		{
+			img->decodedCoeffs = img->addr.nbCoeffs;
+			end_partial (img);
+		}
+		else if (!cinfo->progressive_mode
+		         && (ret == JPEG_ROW_COMPLETED || ret == JPEG_SCAN_COMPLETED))
+		{
+			for (ci = 0; ci < cinfo->comps_in_scan; ci++)
+			{
+				compptr = cinfo->cur_comp_info[ci];
+				rows = (int) cinfo->input_iMCU_row * compptr->v_samp_factor;
+				if (rows > (int) compptr->height_in_blocks)
+					rows = (int) compptr->height_in_blocks;
+				if (rows > img->decodedRows[compptr->component_index])
+					img->decodedRows[compptr->component_index] = rows;
+			}
+			img->decodedCoeffs = decoded_prefix (img);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+
+JPEGimg *jpeg_read_windowed (char *path, long maxMem, int windowRows)
+{
+	FILE *infile = NULL;
+	JPEGimg *img = NULL;
+	long size;
+
+	// Check args
+	if (!path || maxMem <= 0 || windowRows <= 0)
+	{
+		print_err ("jpeg_read_windowed()", "path, maxMem or windowRows", ERR_ARG);
+		return NULL;
+	}
+
+	// Open path
+	if ((infile = fopen(path, "rb") ) == NULL)
+	{
+		print_err ("jpeg_read_windowed()", path, ERR_FOPEN);
+		return NULL;
+	}
+
+	// Memory allocation for img
+	if ((img = init_jpeg_img()) == NULL)
+	{
+		fclose (infile);
+		return NULL;
+	}
+
+	// Initialize the JPEG decompression object with default error handling.
+	img->cinfo->err = trap_error (&img->jerr);
+	jpeg_create_decompress (img->cinfo);
+
+	// Size of the cover, used to preallocate the output when writing
+	if (fseek (infile, 0, SEEK_END) == 0 && (size = ftell (infile)) > 0)
+		img->srcSize = (unsigned long) size;
+	rewind (infile);
+
+	jpeg_mmap_src (img->cinfo, infile);
+	(void) jpeg_read_header (img->cinfo, TRUE);
+
+	/* The arrays are realized by the memory manager within maxMem, the rows
+	 * that do not fit being paged to its backing store; every array can be
+	 * accessed windowRows rows at a time */
+	img->cinfo->mem->max_memory_to_use = maxMem;
+	img->cinfo->mem->barray_window_rows = (JDIMENSION) windowRows;
+	img->windowRows = windowRows;
+	img->cinfo->restart_threads = img->restartThreads;
+	img->virtCoeffs = jpeg_read_coefficients (img->cinfo);
+	(*img->cinfo->src->term_source) (img->cinfo);
+	fclose (infile);
+
+	// No direct access arrays: the coefficients are only reachable through jpeg_window
+	build_dct_addr (img);
+	img->decodedCoeffs = img->addr.nbCoeffs;
+
+	return img;
+}
+
+
+JBLOCKARRAY jpeg_window (JPEGimg *img, int comp, int lin, int nbRows, int writable)
+{
+	// Check arguments
+	if (!img || !img->windowRows || comp < 0 || comp >= img->cinfo->num_components
+	    || lin < 0 || nbRows <= 0 || nbRows > img->windowRows
+	    || lin + nbRows > (int) img->cinfo->comp_info[comp].height_in_blocks)
+	{
+		print_err ("jpeg_window()", "img, comp, lin or nbRows", ERR_ARG);
+		return NULL;
+	}
+
+	// Rows written through the previous window are paged out if they have to
+	return (img->cinfo->mem->access_virt_barray) ((j_common_ptr) img->cinfo,
+		img->virtCoeffs[comp], (JDIMENSION) lin, (JDIMENSION) nbRows, writable ? TRUE : FALSE);
+}
+
+
+/* FNV-1a hash of the n bytes of buf, continuing from hash */
+static uint64_t fnv1a (uint64_t hash, const unsigned char *buf, size_t n)
+{
+	while (n--)
+		hash = (hash ^ *buf++) * 0x100000001b3ULL;
+	return hash;
+}
+
+
+/* Fingerprint of the file at path: its size and modification time, and a
+ * hash of its first and last JPEG_CACHE_PRINT bytes. The cache is not
+ * trusted on dates alone, which cp -p, rsync -t or a restore carry over
+ * from another file of the same size. Returns 0 if the file can be read */
+static int cover_fingerprint (const char *path, uint64_t *size, int64_t *mtime, uint64_t *hash)
+{
+	unsigned char buf[JPEG_CACHE_PRINT];
+	struct stat st;
+	FILE *input;
+	size_t head, tail;
+	int ok;
+
+	if ((input = fopen (path, "rb")) == NULL)
+		return -1;
+	if (fstat (fileno (input), &st) != 0)
+	{
+		fclose (input);
+		return -1;
+	}
+	*size = (uint64_t) st.st_size;
+	*mtime = (int64_t) st.st_mtime;
+
+	// The tail does not overlap the head for covers shorter than two parts
+	head = *size < JPEG_CACHE_PRINT ? (size_t) *size : JPEG_CACHE_PRINT;
+	tail = *size - head < JPEG_CACHE_PRINT ? (size_t) (*size - head) : JPEG_CACHE_PRINT;
+	*hash = 0xcbf29ce484222325ULL;
+	ok = fread (buf, 1, head, input) == head;
+	*hash = fnv1a (*hash, buf, head);
+	ok = ok && fseek (input, (long) (*size - tail), SEEK_SET) == 0
+	     && fread (buf, 1, tail, input) == tail;
+	*hash = fnv1a (*hash, buf, tail);
+	fclose (input);
+	return ok ? 0 : -1;
+}
+
+
+int jpeg_write_cache (char *path, char *cover, JPEGimg *img)
+{
+	JPEGcacheHeader hdr;
+	uint64_t coverSize;
+	jpeg_component_info *compptr;
+	sjdec *cinfo;
+	JCOEF *coef;
+	FILE *output = NULL;
+	int comp, tbl, k, ok;
+
+	// Check args
+	if (!path || !img || !img->dctCoeffs)
+	{
+		print_err ("jpeg_write_cache()", "path or img", ERR_ARG);
+		return ERR_ARG;
+	}
+
+	// The coefficients are written as the flat view lays them out
+	if ((coef = jpeg_flat_coeffs (img)) == NULL)
+		return ERR_ARG;
+	cinfo = img->cinfo;
+
+	memset (&hdr, 0, sizeof(hdr));
+	memcpy (hdr.magic, JPEG_CACHE_MAGIC, sizeof(JPEG_CACHE_MAGIC));
+	hdr.version = JPEG_CACHE_VERSION;
+	hdr.byteOrder = 0x01020304;
+	hdr.dataOffset = (sizeof(hdr) + JPEG_CACHE_ALIGN - 1) & ~(uint64_t) (JPEG_CACHE_ALIGN - 1);
+	hdr.nbCoeffs = (uint64_t) img->addr.nbCoeffs;
+	hdr.srcSize = img->srcSize;
+	if (cover)
+	{
+		if (cover_fingerprint (cover, &coverSize, &hdr.srcMtime, &hdr.srcHash) != 0)
+		{
+			print_err ("jpeg_write_cache()", cover, ERR_FOPEN);
+			return ERR_FOPEN;
+		}
+		hdr.srcSize = coverSize;
+	}
+
+	// What jpeg_copy_critical_parameters takes from the source image
+	hdr.imageWidth = cinfo->image_width;
+	hdr.imageHeight = cinfo->image_height;
+	hdr.outputWidth = cinfo->output_width;
+	hdr.outputHeight = cinfo->output_height;
+	hdr.numComponents = (uint16_t) cinfo->num_components;
+	hdr.colorSpace = (uint16_t) cinfo->jpeg_color_space;
+	hdr.dataPrecision = (uint16_t) cinfo->data_precision;
+	hdr.ccir601 = (uint16_t) cinfo->CCIR601_sampling;
+	hdr.minDCThScaled = (uint16_t) cinfo->min_DCT_h_scaled_size;
+	hdr.minDCTvScaled = (uint16_t) cinfo->min_DCT_v_scaled_size;
+	hdr.sawJFIF = (uint16_t) cinfo->saw_JFIF_marker;
+	hdr.jfifMajor = cinfo->JFIF_major_version;
+	hdr.jfifMinor = cinfo->JFIF_minor_version;
+	hdr.densityUnit = cinfo->density_unit;
+	hdr.xDensity = cinfo->X_density;
+	hdr.yDensity = cinfo->Y_density;
+	for (tbl = 0; tbl < NUM_QUANT_TBLS; tbl++)
+	{
+		if (!cinfo->quant_tbl_ptrs[tbl])
+			continue;
+		hdr.quantMask |= 1 << tbl;
+		for (k = 0; k < DCTSIZE2; k++)
+			hdr.quant[tbl][k] = cinfo->quant_tbl_ptrs[tbl]->quantval[k];
+	}
+	for (comp = 0; comp < cinfo->num_components; comp++)
+	{
+		compptr = &cinfo->comp_info[comp];
+		hdr.comp[comp].id = (uint16_t) compptr->component_id;
+		hdr.comp[comp].hSamp = (uint16_t) compptr->h_samp_factor;
+		hdr.comp[comp].vSamp = (uint16_t) compptr->v_samp_factor;
+		hdr.comp[comp].quantTbl = (uint16_t) compptr->quant_tbl_no;
+		hdr.comp[comp].width = compptr->width_in_blocks;
+		hdr.comp[comp].height = compptr->height_in_blocks;
+	}
+
+	// Header, then the coefficients from dataOffset (the gap reads as zeros)
+	if ((output = fopen (path, "wb")) == NULL)
+	{
+		print_err ("jpeg_write_cache()", path, ERR_FOPEN);
+		return ERR_FOPEN;
+	}
+	ok = fwrite (&hdr, sizeof(hdr), 1, output) == 1
+	     && fseek (output, (long) hdr.dataOffset, SEEK_SET) == 0
+	     && fwrite (coef, sizeof(JCOEF), (size_t) hdr.nbCoeffs, output) == (size_t) hdr.nbCoeffs;
+	if (fclose (output) != 0 || !ok)
+	{
+		print_err ("jpeg_write_cache()", path, ERR_FOPEN);
+		return ERR_FOPEN;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+
+/* True if the mapped file of size bytes starts with a cache header this
+ * build can read, whose coefficients are all inside the file. The size of
+ * each component must be the one the image size and sampling factors give
+ * (as in jdinput.c): the encoder reads as many blocks as that size says */
+static int cache_header_valid (const JPEGcacheHeader *hdr, size_t size)
+{
+	const JPEGcacheComp *c;
+	uint64_t nbBlocks = 0, hDiv, vDiv;
+	int comp, maxH = 0, maxV = 0;
+
+	if (size < sizeof(*hdr)
+	    || memcmp (hdr->magic, JPEG_CACHE_MAGIC, sizeof(JPEG_CACHE_MAGIC))
+	    || hdr->version != JPEG_CACHE_VERSION || hdr->byteOrder != 0x01020304
+	    || hdr->numComponents < 1 || hdr->numComponents > MAX_COMPONENTS
+	    || hdr->imageWidth < 1 || hdr->imageWidth > JPEG_MAX_DIMENSION
+	    || hdr->imageHeight < 1 || hdr->imageHeight > JPEG_MAX_DIMENSION
+	    || hdr->dataOffset < sizeof(*hdr) || hdr->dataOffset % JPEG_CACHE_ALIGN
+	    || hdr->nbCoeffs > (uint64_t) INT_MAX
+	    || hdr->dataOffset > size
+	    || hdr->nbCoeffs * sizeof(JCOEF) > size - hdr->dataOffset)
+		return 0;
+
+	for (comp = 0; comp < hdr->numComponents; comp++)
+	{
+		c = &hdr->comp[comp];
+		if (c->hSamp < 1 || c->hSamp > MAX_SAMP_FACTOR
+		    || c->vSamp < 1 || c->vSamp > MAX_SAMP_FACTOR
+		    || c->quantTbl >= NUM_QUANT_TBLS
+		    || !(hdr->quantMask & (1 << c->quantTbl)))
+			return 0;
+		if (c->hSamp > maxH)
+			maxH = c->hSamp;
+		if (c->vSamp > maxV)
+			maxV = c->vSamp;
+	}
+
+	hDiv = (uint64_t) maxH * DCTSIZE;
+	vDiv = (uint64_t) maxV * DCTSIZE;
+	for (comp = 0; comp < hdr->numComponents; comp++)
+	{
+		c = &hdr->comp[comp];
+		if (c->width != ((uint64_t) hdr->imageWidth * c->hSamp + hDiv - 1) / hDiv
+		    || c->height != ((uint64_t) hdr->imageHeight * c->vSamp + vDiv - 1) / vDiv)
+			return 0;
+		nbBlocks += (uint64_t) c->width * c->height;
+	}
+	return nbBlocks * DCTSIZE2 == hdr->nbCoeffs;
+}
+
+
+JPEGimg *jpeg_read_cache (char *path)
+{
+	const JPEGcacheHeader *hdr;
+	jpeg_component_info *compptr;
+	JBLOCKARRAY rows;
+	JBLOCKROW data, padRow;
+	struct stat st;
+	FILE *infile = NULL;
+	JPEGimg *img = NULL;
+	sjdec *cinfo;
+	void *map;
+	JDIMENSION blocksPerRow, nbRows, lin;
+	int comp, tbl, k;
+
+	// Check args
+	if (!path)
+	{
+		print_err ("jpeg_read_cache()", "path", ERR_ARG);
+		return NULL;
+	}
+
+	// Open path
+	if ((infile = fopen(path, "rb") ) == NULL)
+	{
+		print_err ("jpeg_read_cache()", path, ERR_FOPEN);
+		return NULL;
+	}
+
+	/* Private writable mapping: the coefficients are modified in place, the
+	 * pages touched are copied by the kernel and the file never changes */
+	if (fstat (fileno (infile), &st) != 0 || st.st_size <= 0
+	    || (map = mmap (NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	                    fileno (infile), 0)) == MAP_FAILED)
+	{
+		print_err ("jpeg_read_cache()", path, ERR_FREAD);
+		fclose (infile);
+		return NULL;
+	}
+	fclose (infile);
+
+	hdr = (const JPEGcacheHeader*) map;
+	if (!cache_header_valid (hdr, (size_t) st.st_size))
+	{
+		print_err ("jpeg_read_cache()", path, ERR_FREAD);
+		munmap (map, (size_t) st.st_size);
+		return NULL;
+	}
+
+	// Memory allocation for img, which owns the mapping from now on
+	if ((img = init_jpeg_img()) == NULL)
+	{
+		munmap (map, (size_t) st.st_size);
+		return NULL;
+	}
+	img->cacheMap = map;
+	img->cacheSize = (size_t) st.st_size;
+	img->srcSize = (unsigned long) hdr->srcSize;
+
+	// Initialize the JPEG decompression object with default error handling.
+	img->cinfo->err = trap_error (&img->jerr);
+	jpeg_create_decompress (img->cinfo);
+	cinfo = img->cinfo;
+
+	/* Fill in what jpeg_read_header would have read, as far as the writing
+	 * of the image (jpeg_copy_critical_parameters) and jpeg_manip use it */
+	cinfo->image_width = hdr->imageWidth;
+	cinfo->image_height = hdr->imageHeight;
+	cinfo->output_width = hdr->outputWidth;
+	cinfo->output_height = hdr->outputHeight;
+	cinfo->num_components = hdr->numComponents;
+	cinfo->jpeg_color_space = (J_COLOR_SPACE) hdr->colorSpace;
+	cinfo->data_precision = hdr->dataPrecision;
+	cinfo->CCIR601_sampling = (boolean) hdr->ccir601;
+	cinfo->min_DCT_h_scaled_size = hdr->minDCThScaled;
+	cinfo->min_DCT_v_scaled_size = hdr->minDCTvScaled;
+	cinfo->saw_JFIF_marker = (boolean) hdr->sawJFIF;
+	cinfo->JFIF_major_version = (UINT8) hdr->jfifMajor;
+	cinfo->JFIF_minor_version = (UINT8) hdr->jfifMinor;
+	cinfo->density_unit = (UINT8) hdr->densityUnit;
+	cinfo->X_density = hdr->xDensity;
+	cinfo->Y_density = hdr->yDensity;
+	for (tbl = 0; tbl < NUM_QUANT_TBLS; tbl++)
+	{
+		if (!(hdr->quantMask & (1 << tbl)))
+			continue;
+		cinfo->quant_tbl_ptrs[tbl] = jpeg_alloc_quant_table ((j_common_ptr) cinfo);
+		for (k = 0; k < DCTSIZE2; k++)
+			cinfo->quant_tbl_ptrs[tbl]->quantval[k] = hdr->quant[tbl][k];
+	}
+	cinfo->comp_info = (jpeg_component_info*) (cinfo->mem->alloc_small) ((j_common_ptr) cinfo,
+		JPOOL_IMAGE, cinfo->num_components * sizeof(jpeg_component_info));
+	memset (cinfo->comp_info, 0, cinfo->num_components * sizeof(jpeg_component_info));
+	for (comp = 0; comp < cinfo->num_components; comp++)
+	{
+		compptr = &cinfo->comp_info[comp];
+		compptr->component_index = comp;
+		compptr->component_id = hdr->comp[comp].id;
+		compptr->h_samp_factor = hdr->comp[comp].hSamp;
+		compptr->v_samp_factor = hdr->comp[comp].vSamp;
+		compptr->quant_tbl_no = hdr->comp[comp].quantTbl;
+		compptr->width_in_blocks = hdr->comp[comp].width;
+		compptr->height_in_blocks = hdr->comp[comp].height;
+		compptr->component_needed = TRUE;
+		if (compptr->h_samp_factor > cinfo->max_h_samp_factor)
+			cinfo->max_h_samp_factor = compptr->h_samp_factor;
+		if (compptr->v_samp_factor > cinfo->max_v_samp_factor)
+			cinfo->max_v_samp_factor = compptr->v_samp_factor;
+	}
+	build_dct_addr (img);
+
+	// Structure allocation, for any number of components as in start_coeffs
+	if ((img->dctCoeffs = (JBLOCKARRAY*) malloc (sizeof(JBLOCKARRAY) * MAX_COMPONENTS)) == NULL)
+	{
+		print_err ("jpeg_read_cache()", "img->dctCoeffs", ERR_MEM);
+		free_jpeg_img (img);
+		return NULL;
+	}
+	img->virtCoeffs = (jvirt_barray_ptr*) (cinfo->mem->alloc_small) ((j_common_ptr) cinfo,
+		JPOOL_IMAGE, cinfo->num_components * sizeof(jvirt_barray_ptr));
+
+	/* The rows of each component point into the mapping and become the
+	 * virtual arrays written by jpeg_write_coefficients. The arrays are as
+	 * large as jdcoefct makes them (padded to the sampling factors); the
+	 * encoder never reads the padding, whose rows share one zero row */
+	data = (JBLOCKROW) ((char*) map + hdr->dataOffset);
+	for (comp = 0; comp < cinfo->num_components; comp++)
+	{
+		compptr = &cinfo->comp_info[comp];
+		blocksPerRow = (compptr->width_in_blocks + compptr->h_samp_factor - 1)
+		               / compptr->h_samp_factor * compptr->h_samp_factor;
+		nbRows = (compptr->height_in_blocks + compptr->v_samp_factor - 1)
+		         / compptr->v_samp_factor * compptr->v_samp_factor;
+		rows = (JBLOCKARRAY) (cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_IMAGE,
+			nbRows * sizeof(JBLOCKROW));
+		for (lin = 0; lin < compptr->height_in_blocks; lin++)
+		{
+			rows[lin] = data;
+			data += compptr->width_in_blocks;
+		}
+		if (lin < nbRows)
+		{
+			padRow = (cinfo->mem->alloc_barray) ((j_common_ptr) cinfo, JPOOL_IMAGE, blocksPerRow, 1)[0];
+			memset (padRow, 0, blocksPerRow * sizeof(JBLOCK));
+			for (; lin < nbRows; lin++)
+				rows[lin] = padRow;
+		}
+		img->virtCoeffs[comp] = (cinfo->mem->wrap_virt_barray) ((j_common_ptr) cinfo,
+			JPOOL_IMAGE, rows, blocksPerRow, nbRows);
+		img->dctCoeffs[comp] = rows;
+	}
+
+	// The mapping is the flat view: no copy, nothing to flush before writing
+	img->flatCoeffs = (JCOEF*) ((char*) map + hdr->dataOffset);
+	img->decodedCoeffs = img->addr.nbCoeffs;
+
+	return img;
+}
+
+
+int jpeg_is_cache (const char *path)
+{
+	size_t len = path ? strlen (path) : 0;
+
+	return len >= sizeof(JPEG_CACHE_EXT)
+	       && strcmp (path + len - (sizeof(JPEG_CACHE_EXT) - 1), JPEG_CACHE_EXT) == 0;
+}
+
+
+JPEGimg *jpeg_read_cached (char *path)
+{
+	const JPEGcacheHeader *hdr;
+	struct stat cacheStat;
+	JPEGimg *img = NULL;
+	uint64_t size, hash;
+	int64_t mtime;
+	char *cache, *ext;
+
+	// Check args
+	if (!path)
+	{
+		print_err ("jpeg_read_cached()", "path", ERR_ARG);
+		return NULL;
+	}
+	if (jpeg_is_cache (path))
+		return jpeg_read_cache (path);
+
+	// Cache name: the path of the cover, its extension replaced by JPEG_CACHE_EXT
+	if ((cache = (char*) malloc (strlen (path) + sizeof(JPEG_CACHE_EXT))) == NULL)
+	{
+		print_err ("jpeg_read_cached()", "cache", ERR_MEM);
+		return NULL;
+	}
+	strcpy (cache, path);
+	if ((ext = strrchr (cache, '.')) == NULL || strchr (ext, '/') != NULL)
+		ext = cache + strlen (cache);
+	strcpy (ext, JPEG_CACHE_EXT);
+
+	/* A cache whose fingerprint is not the cover's was written for another
+	 * file, or a previous version of this one, and is ignored */
+	if (stat (cache, &cacheStat) == 0
+	    && cover_fingerprint (path, &size, &mtime, &hash) == 0
+	    && (img = jpeg_read_cache (cache)) != NULL)
+	{
+		hdr = (const JPEGcacheHeader*) img->cacheMap;
+		if (hdr->srcSize != size || hdr->srcMtime != mtime || hdr->srcHash != hash)
+		{
+			free_jpeg_img (img);
+			img = NULL;
+		}
+	}
+
+	free (cache);
+	return img;
+}
+
+
+JPEGimg *jpeg_read_cover (char *path)
+{
+	JPEGimg *img;
+
+	if ((img = jpeg_read_cached (path)) != NULL || !path || jpeg_is_cache (path))
+		return img;
+	return jpeg_read (path);
+}
+
+
+/* Count the coefficients of the arrays read by jpeg_read_coefficients into
+ * cap, for the files jpeg_count_coefficients cannot count */
+static void count_arrays (sjdec *cinfo, jvirt_barray_ptr *arrays, JPEGcapacity *cap)
+{
+	jpeg_component_info *compptr;
+	JBLOCKARRAY rows;
+	JCOEF *block;
+	int comp, lin, col, k;
+
+	for (comp = 0; comp < cinfo->num_components; comp++)
+	{
+		compptr = &cinfo->comp_info[comp];
+		for (lin = 0; lin < (int) compptr->height_in_blocks; lin++)
+		{
+			rows = (cinfo->mem -> access_virt_barray)((j_common_ptr) cinfo,
+				arrays[comp], lin, 1, FALSE);
+			for (col = 0; col < (int) compptr->width_in_blocks; col++)
+			{
+				block = rows[0][col];
+				cap->nbNonZero += (block[0] != 0);
+				for (k = 1; k < DCTSIZE2; k++)
+					cap->nbNonZeroAC += (block[k] != 0);
+			}
+			cap->nbCoeffs += compptr->width_in_blocks * DCTSIZE2;
+		}
+	}
+	cap->nbNonZero += cap->nbNonZeroAC;
+}
+
+
+int jpeg_probe_capacity (char *path, JPEGcapacity *cap)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	jpeg_coef_counts counts;
+	FILE *infile = NULL;
+	int ret = EXIT_SUCCESS;
+
+	// Check args
+	if (!path || !cap)
+	{
+		print_err ("jpeg_probe_capacity()", "path", ERR_ARG);
+		return ERR_ARG;
+	}
+
+	// Open path
+	if ((infile = fopen(path, "rb") ) == NULL)
+	{
+		print_err ("jpeg_probe_capacity()", path, ERR_FOPEN);
+		return ERR_FOPEN;
+	}
+
+	// A decompression object of its own, which keeps no coefficient
+	cinfo.err = jpeg_std_error (&jerr);
+	jpeg_create_decompress (&cinfo);
+	jpeg_mmap_src (&cinfo, infile);
+	(void) jpeg_read_header (&cinfo, TRUE);
+
+	memset (cap, 0, sizeof(JPEGcapacity));
+	if (cinfo.progressive_mode)
+		// The coefficients are final only once the whole file is read
+		count_arrays (&cinfo, jpeg_read_coefficients (&cinfo), cap);
+	else if (jpeg_count_coefficients (&cinfo, &counts))
+	{
+		cap->nbCoeffs = counts.num_blocks * DCTSIZE2;
+		cap->nbNonZeroAC = counts.nonzero_ac;
+		cap->nbNonZero = counts.nonzero_dc + counts.nonzero_ac;
+	}
+	else
+		ret = ERR_FREAD;
+
+	(*cinfo.src->term_source) (&cinfo);
+	jpeg_destroy_decompress (&cinfo);
+	fclose (infile);
+
+	return ret;
+}
+
+
+JPEGimg *jpeg_read_mem (const unsigned char *buf, unsigned long size)
+{
+	JPEGimg *img = NULL;
+
+	// Check args
+	if (!buf || !size)
+	{
+		print_err ("jpeg_read_mem()", "buf", ERR_ARG);
+		return NULL;
+	}
+
+	// Memory allocation for img
+	if ((img = init_jpeg_img()) == NULL)
+		return NULL;
+
+	// Initialize the JPEG decompression object with default error handling.
+	img->cinfo->err = trap_error (&img->jerr);
+	jpeg_create_decompress (img->cinfo);
+
+	img->srcSize = size;
+
+	// The decoder reads the caller's buffer in place (it is never written)
+	jpeg_mem_src (img->cinfo, (unsigned char*) buf, size);
+
+	return read_coeffs (img);
+}
+
+
+int jpeg_write_from_coeffs (char *outfile, JPEGimg *img)
+{
+	struct jpeg_compress_struct cinfo;
+	JPEGerror jerr;
+	FILE *output = NULL;
+
+	// Open file
+	if ((output = fopen (outfile, "wb")) == NULL)
+	{
+		print_err( "jpeg_write_from_coeffs()", outfile, ERR_FOPEN);
+		return ERR_FOPEN;
+	}
+	
+	// Initialize the JPEG compression object with default error handling. 
+	cinfo.err = trap_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	// A fatal libjpeg error leaves no partial output behind
+	if (setjmp (jerr.env))
+	{
+		jpeg_destroy_compress(&cinfo);
+		fclose (output);
+		remove (outfile);
+		print_err( "jpeg_write_from_coeffs()", "jpeg_write_coefficients()", ERR_TREAT);
+		return ERR_TREAT;
+	}
+	jerr.armed = 1;
+	
+	// telling where to put jpeg data: one buffer, written at once
+	jpeg_grow_dest(&cinfo, output, NULL, NULL, output_size_hint (img));
+
+	write_coeffs (img, &cinfo);
+	fclose (output);
+	
+	/*Done!*/
+	return EXIT_SUCCESS;
+}
+
+
+int jpeg_write_mem (JPEGimg *img, unsigned char **buf, unsigned long *size)
+{
+	struct jpeg_compress_struct cinfo;
+	JPEGerror jerr;
+
+	// Check args
+	if (!img || !buf || !size)
+	{
+		print_err ("jpeg_write_mem()", "buf", ERR_ARG);
+		return ERR_ARG;
+	}
+
+	// Initialize the JPEG compression object with default error handling. 
+	cinfo.err = trap_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	if (setjmp (jerr.env))
+	{
+		jpeg_destroy_compress(&cinfo);
+		print_err ("jpeg_write_mem()", "jpeg_write_coefficients()", ERR_TREAT);
+		return ERR_TREAT;
+	}
+	jerr.armed = 1;
+
+	// Written in place into the caller's buffer (reallocated by the libjpeg only if it is
+	// too small), or into a new buffer sized from the cover
+	if (*buf && *size)
+		jpeg_mem_dest(&cinfo, buf, size);
+	else
+		jpeg_grow_dest(&cinfo, NULL, buf, size, output_size_hint (img));
+
+	write_coeffs (img, &cinfo);
+
+	return EXIT_SUCCESS;
+}
+
+
+/* True if the coefficient rows of img follow each other in memory in the
+ * order of getDCTpos, from an address aligned on FLAT_ALIGN. This is the case
+ * when the libjpeg realized them in one allocation (contiguous_barrays) and
+ * no component was padded to a multiple of its sampling factors */
+static int coeffs_contiguous (JPEGimg *img)
+{
+	jpeg_component_info *compptr;
+	JBLOCKROW next = img->dctCoeffs[0][0];
+	int comp, lin;
+
+	if ((size_t) next & (FLAT_ALIGN - 1))
+		return 0;
+	for (comp = 0; comp < img->cinfo->num_components; comp++)
+	{
+		compptr = &img->cinfo->comp_info[comp];
+		for (lin = 0; lin < (int) compptr->height_in_blocks; lin++)
+		{
+			if (img->dctCoeffs[comp][lin] != next)
+				return 0;
+			next += compptr->width_in_blocks;
+		}
+	}
+	return 1;
+}
+
+
+JCOEF *jpeg_flat_coeffs (JPEGimg *img)
+{
+	jpeg_component_info *compptr;
+	JBLOCKROW *rowPtr;
+	JCOEF *dst;
+	int comp, lin, nbRows = 0;
+
+	// Check arguments
+	if (!img || !img->dctCoeffs)
+	{
+		print_err ("jpeg_flat_coeffs()", "img", ERR_ARG);
+		return NULL;
+	}
+	if (img->flatCoeffs)
+		return img->flatCoeffs;
+	if (img->decodedCoeffs < img->addr.nbCoeffs)
+	{
+		print_err ("jpeg_flat_coeffs()", "img (partially decoded)", ERR_ARG);
+		return NULL;
+	}
+
+	// The libjpeg arrays already have the layout of the flat view: no copy
+	if (coeffs_contiguous (img))
+	{
+		img->flatCoeffs = img->dctCoeffs[0][0][0];
+		return img->flatCoeffs;
+	}
+
+	for (comp = 0; comp < img->cinfo->num_components; comp++)
+		nbRows += img->cinfo->comp_info[comp].height_in_blocks;
+
+	/* Buffer allocation, the coefficients start on a cache line. The buffers
+	 * of the previous image of a jpeg_read_into series are reused */
+	if (!img->flatAlloc
+	    && (img->flatAlloc = malloc (img->addr.nbCoeffs * sizeof(JCOEF) + FLAT_ALIGN - 1)) == NULL)
+	{
+		print_err ("jpeg_flat_coeffs()", "img->flatAlloc", ERR_MEM);
+		return NULL;
+	}
+	if (!img->flatRows
+	    && (img->flatRows = (JBLOCKROW*) malloc (nbRows * sizeof(JBLOCKROW))) == NULL)
+	{
+		print_err ("jpeg_flat_coeffs()", "img->flatRows", ERR_MEM);
+		free (img->flatAlloc);
+		img->flatAlloc = NULL;
+		return NULL;
+	}
+	img->flatCoeffs = (JCOEF*) (((size_t) img->flatAlloc + FLAT_ALIGN - 1) & ~(size_t) (FLAT_ALIGN - 1));
+
+	/* Copy the coefficients in scan order and point dctCoeffs at the copy,
+	 * so that every accessor works on the flat buffer from now on */
+	dst = img->flatCoeffs;
+	rowPtr = img->flatRows;
+	for (comp = 0; comp < img->cinfo->num_components; comp++)
+	{
+		compptr = &img->cinfo->comp_info[comp];
+		for (lin = 0; lin < (int) compptr->height_in_blocks; lin++)
+		{
+			memcpy (dst, img->dctCoeffs[comp][lin], compptr->width_in_blocks * sizeof(JBLOCK));
+			rowPtr[lin] = (JBLOCKROW) dst;
+			dst += compptr->width_in_blocks * DCTSIZE2;
+		}
+		img->dctCoeffs[comp] = rowPtr;
+		rowPtr += compptr->height_in_blocks;
+	}
+
+	return img->flatCoeffs;
+}
+
+
+int jpeg_flat_sync (JPEGimg *img)
+{
+	jpeg_component_info *compptr;
+	JBLOCKARRAY virtRows;
+	JBLOCKROW row;
+	HuffStats *stats = NULL;
+	JCOEF *dc = NULL;
+	int comp, lin, col;
+
+	// Check arguments
+	if (!img || !img->flatCoeffs)
+	{
+		print_err ("jpeg_flat_sync()", "img", ERR_ARG);
+		return ERR_ARG;
+	}
+
+	// The Huffman symbols are counted while each row is in cache for the copy
+	if (img->optimizeCoding != JPEG_HUFF_STD)
+		stats = huff_stats_reset (img);
+
+	for (comp = 0; comp < img->cinfo->num_components; comp++)
+	{
+		compptr = &img->cinfo->comp_info[comp];
+		virtRows = (img->cinfo->mem -> access_virt_barray)((j_common_ptr) img->cinfo,
+			img->virtCoeffs[comp], 0, 1, TRUE);
+		if (stats)
+			dc = stats->dc + img->addr.compStart[comp];
+		for (lin = 0; lin < (int) compptr->height_in_blocks; lin++)
+		{
+			row = img->dctCoeffs[comp][lin];
+			if (virtRows[lin] != row)
+				memcpy (virtRows[lin], row, compptr->width_in_blocks * sizeof(JBLOCK));
+			if (!stats)
+				continue;
+			for (col = 0; col < (int) compptr->width_in_blocks; col++)
+			{
+				*dc++ = row[col][0];
+				count_ac_symbols (row[col], stats->ac[comp]);
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+
+int DCTiter_init (DCTiter *it, JPEGimg *img, int flags)
+{
+	// Check arguments
+	if (!it || !img || !img->dctCoeffs)
+	{
+		print_err ("DCTiter_init()", "it or img", ERR_ARG);
+		return ERR_ARG;
+	}
+
+	// Empty row before the first one: the first step loads row 0 of component 0
+	it->img = img;
+	it->flags = flags;
+	it->comp = 0;
+	it->lin = -1;
+	it->cur = it->rowStart = it->rowEnd = NULL;
+	it->rowPos = 0;
+
+	return EXIT_SUCCESS;
+}
+
+
+int DCTiter_nextRow (DCTiter *it)
+{
+	sjdec *cinfo = it->img->cinfo;
+	int width;
+
+	it->rowPos += (int) (it->rowEnd - it->rowStart);
+
+	// Next line, or first line of the next non empty component
+	it->lin++;
+	while (it->comp < cinfo->num_components
+	       && it->lin >= (int) cinfo->comp_info[it->comp].height_in_blocks)
+	{
+		it->comp++;
+		it->lin = 0;
+	}
+	if (it->comp >= cinfo->num_components)
+	{
+		it->rowStart = it->rowEnd = it->cur;
+		return 0;
+	}
+
+	width = cinfo->comp_info[it->comp].width_in_blocks;
+	it->rowStart = it->cur = it->img->dctCoeffs[it->comp][it->lin][0];
+	it->rowEnd = it->rowStart + width * DCTSIZE2;
+
+	return 1;
+}
+
+
+int getDCTpos (JPEGimg *img, int pos, DCTpos * const position)
+{
+	const DCTaddr *addr;
+	unsigned int blk;
+
+	// Check arguments
+	if (!img || !position)
+	{
+		print_err("getDCTpos()", "img, cinfo or position", ERR_ARG);
+		return ERR_ARG;
+	}
+
+	addr = &img->addr;
+	// reset position
+	memset(position, 0, sizeof(DCTpos));
+
+	// Find position in DCT block position
+	position->coeff = pos & 63; // equivalent to pos % 64
+	blk = (unsigned int) pos >> 6; // equivalent to pos / 64
+	
+	// Find component from the prefix offsets of the addressing table
+	for (int c = 1; c < MAX_COMPONENTS; c++)
+		position->comp += (blk >= (unsigned int) addr->compStart[c]);
+	blk -= addr->compStart[position->comp];
 	
-	// Find line and column
-	position->col = pos % cinfo->comp_info[position->comp].width_in_blocks;
-	position->lin = pos / cinfo->comp_info[position->comp].width_in_blocks;
+	// Find line and column (division by the width through its reciprocal)
+	position->lin = (int) ((blk * addr->recip[position->comp]) >> addr->shift[position->comp]);
+	position->col = (int) blk - position->lin * addr->width[position->comp];
 	
 	//printf ("Pos = %3d %3d %3d %3d\n", position->comp, position->lin, position->col, position->coeff);
 		
@@ -201,7 +1639,7 @@ int getDCTcoeffValue(JPEGimg *img, DCTpos *pos, int *coeffValue)
 	JBLOCKARRAY* dct_coeffs;
 	sjdec* cinfo;
 	// Check arguments
-	if (!img || !pos || !coeffValue)
+	if (!img || !img->dctCoeffs || !pos || !coeffValue)
 	{
 		print_err("getDCTpos()", "img, cinfo or position", ERR_ARG);
 		return EXIT_FAILURE;
@@ -13,6 +13,9 @@
  * \{
  */
 
+#include <stdint.h>
+#include <setjmp.h>
+
 //#include <jpeglib.h>
 #include "jpeg-8/cdjpeg.h"		/* Common decls for cjpeg/djpeg applications */
 #include "jpeg-8/jversion.h"	/* for version message */
@@ -28,6 +31,63 @@
 #define MIN_DCT_VALUE (-255*32)
 /// @brief nombre de valeurs possibles pour un coefficient DCT
 #define NB_DCT_VALUES (MAX_DCT_VALUE - MIN_DCT_VALUE + 1)
+/// @brief alignement (en octets) du tableau plat de coefficients : une ligne de cache
+#define FLAT_ALIGN 64
+/// \}
+
+/**
+ * \defgroup filtres
+ * \brief Filtres de parcours de DCTiter (combinables avec |)
+ * \{
+ */
+/// @brief parcours de tous les coefficients
+#define DCT_ITER_ALL       0
+/// @brief saute les coefficients nuls
+#define DCT_ITER_SKIP_ZERO 1
+/// @brief saute les coefficients DC (index 0 de chaque bloc)
+#define DCT_ITER_SKIP_DC   2
+/// \}
+
+/**
+ * \defgroup sources
+ * \brief Lecture du fichier par jpeg_read_src
+ * \{
+ */
+/// @brief lecture par fread, INPUT_BUF_SIZE octets à la fois
+#define JPEG_SRC_STDIO 0
+/// @brief fichier projeté en mémoire (mmap) et donné en un seul bloc au décodeur
+#define JPEG_SRC_MMAP  1
+/// \}
+
+/**
+ * \defgroup huffman
+ * \brief Tables de Huffman de l'image écrite (champ optimizeCoding de JPEGimg)
+ * \{
+ */
+/// @brief tables standard
+#define JPEG_HUFF_STD      0
+/// @brief tables optimales si jpeg_flat_sync a relevé les statistiques, standard sinon
+#define JPEG_HUFF_STATS    1
+/// @brief tables optimales dans tous les cas : sans statistiques, la libjpeg fait une passe
+///        de comptage avant l'encodage (deux parcours des coefficients)
+#define JPEG_HUFF_OPTIMIZE 2
+/// \}
+
+/**
+ * \defgroup cache
+ * \brief Fichier cache des coefficients décodés (jpeg_write_cache, jpeg_read_cache)
+ * \{
+ */
+/// @brief signature en tête du fichier cache
+#define JPEG_CACHE_MAGIC   "JPGCOEF"
+/// @brief version du format, incrémentée à chaque changement de JPEGcacheHeader
+#define JPEG_CACHE_VERSION 2
+/// @brief alignement (en octets) des coefficients dans le fichier : une page
+#define JPEG_CACHE_ALIGN   4096
+/// @brief extension des fichiers cache : le cache de photo.jpg est photo.jcc
+#define JPEG_CACHE_EXT     ".jcc"
+/// @brief taille (en octets) du début et de la fin de la cover hachés dans l'empreinte du cache
+#define JPEG_CACHE_PRINT   65536
 /// \}
 
 
@@ -54,6 +114,52 @@ typedef struct DCTpos_s
 }DCTpos;
 
 
+/// @brief Table d'adressage des coefficients DCT, précalculée une fois par image
+///        Permet de convertir une position linéaire en coefficient en temps constant.
+typedef struct DCTaddr_s
+{
+	/// nombre total de coefficients DCT de l'image
+	int nbCoeffs;
+	/// index du premier bloc de chaque composante (INT_MAX pour les composantes absentes)
+	int compStart[MAX_COMPONENTS];
+	/// largeur en blocs de chaque composante
+	int width[MAX_COMPONENTS];
+	/// inverse de la largeur en virgule fixe : lin = (bloc * recip) >> shift
+	unsigned long long recip[MAX_COMPONENTS];
+	/// décalage associé à recip
+	int shift[MAX_COMPONENTS];
+} DCTaddr;
+
+
+/// @brief	Statistiques des symboles de Huffman d'une image, relevées par jpeg_flat_sync pendant
+///			la recopie des coefficients et utilisées par l'écriture pour construire des tables
+///			optimales sans passe de comptage dans la libjpeg
+typedef struct HuffStats_s
+{
+	/// fréquence de chaque symbole AC (longueur de plage << 4 | catégorie) par composante,
+	/// 257 entrées comme l'attend jpeg_gen_optimal_table
+	long ac[MAX_COMPONENTS][257];
+	/// coefficient DC de chaque bloc, dans l'ordre de getDCTpos (les différences DC dépendent
+	/// de l'ordre des MCU et de l'intervalle de restart, elles sont comptées à l'écriture)
+	JCOEF * dc;
+} HuffStats;
+
+
+/// @brief	Gestionnaire d'erreurs de la libjpeg. Pendant les lectures et écritures de jpeg_manip
+///			(armed non nul), une erreur fatale affiche son message puis revient par longjmp dans
+///			la fonction appelante, qui libère ce qu'elle a ouvert et renvoie une erreur. Ailleurs,
+///			le programme se termine, comme avec jpeg_std_error.
+typedef struct JPEGerror_s
+{
+	/// gestionnaire standard de la libjpeg, dont seul error_exit est remplacé
+	struct jpeg_error_mgr pub;
+	/// point de retour des erreurs fatales
+	jmp_buf env;
+	/// non nul tant que env est valide
+	int armed;
+} JPEGerror;
+
+
 /// @brief Structure principale d'une image JPEG
 typedef struct JPEGimg_s
 {
@@ -63,8 +169,137 @@ typedef struct JPEGimg_s
 	sjdec * cinfo;	
 	/// pointeur interne à la libjpeg (ne pas le modifier)
 	jvirt_barray_ptr * virtCoeffs;			
+	/// gestionnaire d'erreurs de la libjpeg, utilisé par cinfo pendant toute la vie de l'image
+	JPEGerror jerr;
+	/// taille du fichier JPEG lu (0 si inconnue), sert à préallouer la sortie
+	unsigned long srcSize;
+	/// intervalle de restart de l'image écrite, en MCU (0 : pas de marqueurs RST). Avec des
+	/// marqueurs, l'encodage de Huffman est réparti entre les cœurs (quelques octets par intervalle)
+	unsigned int restartInterval;
+	/// nombre de threads décodant ou encodant les intervalles de restart d'un scan (0 : un par
+	/// cœur). Les traitements qui occupent déjà tous les cœurs (batch_run) le mettent à 1
+	int restartThreads;
+	/// tables de Huffman de l'image écrite (groupe huffman), JPEG_HUFF_STATS par défaut : tables
+	/// optimales sans surcoût avec une vue plate, dont jpeg_flat_sync relève les statistiques
+	int optimizeCoding;
+	/// statistiques de Huffman (NULL tant que jpeg_flat_sync ne les a pas relevées)
+	HuffStats * huffStats;
+	/// table d'adressage des coefficients (remplie par jpeg_read)
+	DCTaddr addr;
+	/// vue plate des coefficients dans l'ordre de getDCTpos (NULL tant que jpeg_flat_coeffs n'est pas appelée)
+	JCOEF * flatCoeffs;
+	/// zone allouée pour flatCoeffs quand la vue plate n'est pas le tableau de la libjpeg
+	/// lui-même, NULL sinon (ne pas la modifier)
+	void * flatAlloc;
+	/// pointeurs de lignes de dctCoeffs vers flatCoeffs (ne pas les modifier)
+	JBLOCKROW * flatRows;
+	/// nombre de coefficients en tête de l'image (dans l'ordre de getDCTpos) déjà décodés :
+	/// addr.nbCoeffs pour une image lue entièrement, moins pendant une lecture partielle
+	int decodedCoeffs;
+	/// nombre de lignes de blocs déjà décodées de chaque composante (lecture partielle)
+	int decodedRows[MAX_COMPONENTS];
+	/// fichier en cours de lecture par jpeg_read_partial, NULL une fois l'image décodée
+	FILE * partialFile;
+	/// hauteur maximale (en lignes de blocs) des fenêtres de jpeg_window pour une image lue par
+	/// jpeg_read_windowed, 0 sinon
+	int windowRows;
+	/// projection du fichier cache lu par jpeg_read_cache (NULL sinon), dans laquelle pointent
+	/// flatCoeffs et dctCoeffs
+	void * cacheMap;
+	/// taille de cacheMap (en octets)
+	size_t cacheSize;
 } JPEGimg;
 
+
+/// @brief	Géométrie d'une composante dans un fichier cache
+typedef struct JPEGcacheComp_s
+{
+	/// identifiant de la composante (marqueur SOF)
+	uint16_t id;
+	/// facteurs d'échantillonnage horizontal et vertical
+	uint16_t hSamp, vSamp;
+	/// numéro de la table de quantification
+	uint16_t quantTbl;
+	/// largeur et hauteur en blocs
+	uint32_t width, height;
+} JPEGcacheComp;
+
+
+/// @brief	En-tête d'un fichier cache. Le fichier contient cet en-tête puis, à partir de
+///			dataOffset (multiple de JPEG_CACHE_ALIGN), les nbCoeffs coefficients de l'image dans
+///			l'ordre de getDCTpos, c'est-à-dire la vue plate de jpeg_flat_coeffs. Les valeurs sont
+///			écrites dans l'ordre des octets de la machine : un fichier d'une autre architecture
+///			est refusé (byteOrder).
+typedef struct JPEGcacheHeader_s
+{
+	/// JPEG_CACHE_MAGIC
+	char magic[8];
+	/// JPEG_CACHE_VERSION
+	uint32_t version;
+	/// 0x01020304 dans l'ordre des octets de la machine qui a écrit le fichier
+	uint32_t byteOrder;
+	/// position des coefficients dans le fichier (en octets)
+	uint64_t dataOffset;
+	/// nombre de coefficients
+	uint64_t nbCoeffs;
+	/// taille du fichier JPEG d'origine (0 si inconnue)
+	uint64_t srcSize;
+	/// empreinte de la cover : date de modification et hachage FNV-1a de ses JPEG_CACHE_PRINT
+	/// premiers et derniers octets (nulles si le cache a été écrit sans la cover)
+	int64_t srcMtime;
+	uint64_t srcHash;
+	/// dimensions de l'image et de sa sortie (cinfo->output_width, output_height)
+	uint32_t imageWidth, imageHeight, outputWidth, outputHeight;
+	/// nombre de composantes, espace de couleurs, précision des échantillons
+	uint16_t numComponents, colorSpace, dataPrecision, ccir601;
+	/// facteurs d'échelle de la DCT (cinfo->min_DCT_h_scaled_size, min_DCT_v_scaled_size)
+	uint16_t minDCThScaled, minDCTvScaled;
+	/// informations du marqueur JFIF (sawJFIF nul s'il est absent)
+	uint16_t sawJFIF, jfifMajor, jfifMinor, densityUnit, xDensity, yDensity;
+	/// bit t à 1 si la table de quantification t est présente
+	uint16_t quantMask;
+	/// tables de quantification, dans l'ordre naturel
+	uint16_t quant[NUM_QUANT_TBLS][DCTSIZE2];
+	/// géométrie des composantes
+	JPEGcacheComp comp[MAX_COMPONENTS];
+} JPEGcacheHeader;
+
+
+/// @brief	Capacité d'une image, relevée par jpeg_probe_capacity sans garder ses coefficients
+typedef struct JPEGcapacity_s
+{
+	/// nombre de coefficients DCT (basic_insert : 32 + 8 * taille du message au plus)
+	long nbCoeffs;
+	/// nombre de coefficients AC non nuls
+	long nbNonZeroAC;
+	/// nombre de coefficients non nuls, DC compris (advanced_insert : 32 + 8 * taille du
+	/// message au plus)
+	long nbNonZero;
+} JPEGcapacity;
+
+
+/// @brief	Itérateur séquentiel sur les coefficients DCT : composante par composante, ligne par
+///			ligne, bloc par bloc, dans l'ordre de getDCTpos. Initialisé par DCTiter_init.
+typedef struct DCTiter_s
+{
+	/// image parcourue
+	JPEGimg * img;
+	/// filtres DCT_ITER_* appliqués par DCTiter_next
+	int flags;
+	/// composante courante
+	int comp;
+	/// ligne de blocs courante dans la composante
+	int lin;
+	/// prochain coefficient à examiner
+	JCOEF * cur;
+	/// premier coefficient de la ligne de blocs courante
+	JCOEF * rowStart;
+	/// fin de la ligne de blocs courante
+	JCOEF * rowEnd;
+	/// position linéaire (voir getDCTpos) de rowStart
+	int rowPos;
+} DCTiter;
+
 /// \}
 
 /**
@@ -85,18 +320,186 @@ int free_jpeg_img ( JPEGimg *img );
 
 
 /// @brief		Récupère les coefficients DCT de l'image donnée en paramètres
+///				(équivalent à jpeg_read_src (path, JPEG_SRC_MMAP))
 /// @param[in]	path chemin de l'image JPEG à lire
 /// @return		un pointeur sur une structure JPEGimg correctement allouée et initialisée, NULL en cas d'erreur
 JPEGimg * jpeg_read (char *path);
 
 
-/// @brief Ecrit l'image img dans le fichier outfile
+/// @brief		Récupère les coefficients DCT de l'image donnée en paramètres, en choisissant le
+///				mode de lecture du fichier. JPEG_SRC_MMAP se replie sur JPEG_SRC_STDIO pour les
+///				fichiers qui ne peuvent pas être projetés (tubes, fichiers vides).
+/// @param[in]	path	chemin de l'image JPEG à lire
+/// @param[in]	src		JPEG_SRC_STDIO ou JPEG_SRC_MMAP
+/// @return		un pointeur sur une structure JPEGimg correctement allouée et initialisée, NULL en cas d'erreur
+JPEGimg * jpeg_read_src (char *path, int src);
+
+
+/// @brief		Récupère les coefficients DCT d'une image JPEG déjà en mémoire, sans fichier
+///				intermédiaire. Le tampon est lu sur place et peut être libéré dès le retour.
+/// @param[in]	buf		contenu du fichier JPEG
+/// @param[in]	size	taille de buf (en octets)
+/// @return		un pointeur sur une structure JPEGimg correctement allouée et initialisée, NULL en cas d'erreur
+JPEGimg * jpeg_read_mem (const unsigned char *buf, unsigned long size);
+
+
+/// @brief		Lit une image dans une structure JPEGimg existante, pour traiter une série de
+///				fichiers sans tout réallouer. L'objet de décompression de la libjpeg est créé à la
+///				première lecture puis conservé, ainsi que la zone des coefficients et les tampons
+///				de la vue plate et des statistiques de Huffman, tant que la géométrie (composantes,
+///				blocs par ligne et par composante) ne change pas. L'image précédente est perdue,
+///				ainsi que les pointeurs obtenus sur ses coefficients.
+/// @param[in,out] img	structure créée par init_jpeg_img ou lue par une fonction jpeg_read*
+/// @param[in]	path	chemin de l'image JPEG à lire (projeté en mémoire comme avec jpeg_read)
+/// @return		EXIT_SUCCESS si tout ok, une valeur négative en cas d'erreur (img reste à libérer
+///				par free_jpeg_img)
+int jpeg_read_into (JPEGimg *img, char *path);
+
+
+/// @brief		Commence la lecture d'une image sans décoder ses coefficients : l'en-tête est lu
+///				et les tableaux sont alloués, puis jpeg_decode_until décode l'image par le haut,
+///				ligne de MCU par ligne de MCU, autant que nécessaire. Pour extraire un message
+///				court d'une grande image sans la décoder entièrement.
+/// @param[in]	path	chemin de l'image JPEG à lire
+/// @return		la structure JPEGimg (img->decodedCoeffs vaut 0), NULL en cas d'erreur
+JPEGimg * jpeg_read_partial (char *path);
+
+
+/// @brief		Poursuit le décodage d'une image ouverte par jpeg_read_partial jusqu'à ce que ses
+///				nbCoeffs premiers coefficients (dans l'ordre de getDCTpos) soient connus. Les
+///				suivants ne doivent pas être lus : ils peuvent ne pas être encore décodés. Une
+///				image progressive est décodée entièrement, ses coefficients n'étant définitifs
+///				qu'après le dernier scan. Avec nbCoeffs >= img->addr.nbCoeffs, l'image est
+///				entièrement lue et s'utilise ensuite comme une image de jpeg_read.
+/// @param[in,out] img	image ouverte par jpeg_read_partial
+/// @param[in]	nbCoeffs	nombre de coefficients nécessaires
+/// @return		EXIT_SUCCESS si tout ok, une valeur négative en cas d'erreur
+int jpeg_decode_until (JPEGimg *img, int nbCoeffs);
+
+
+/// @brief		Lit une image trop grande pour être gardée en mémoire : la libjpeg range ses
+///				coefficients dans au plus maxMem octets et pagine le reste dans un fichier
+///				temporaire. Les coefficients ne sont accessibles que par bandes de lignes de blocs,
+///				avec jpeg_window ; dctCoeffs reste NULL, la vue plate, les itérateurs et
+///				jpeg_read_into sont refusés. L'image s'écrit avec jpeg_write_from_coeffs.
+/// @param[in]	path		chemin de l'image JPEG à lire
+/// @param[in]	maxMem		mémoire (en octets) accordée aux coefficients
+/// @param[in]	windowRows	hauteur maximale des fenêtres demandées à jpeg_window
+/// @return		la structure JPEGimg, NULL en cas d'erreur
+JPEGimg * jpeg_read_windowed (char *path, long maxMem, int windowRows);
+
+
+/// @brief		Donne accès aux lignes de blocs [lin, lin + nbRows[ d'une composante d'une image lue
+///				par jpeg_read_windowed, en les relisant au besoin depuis le fichier temporaire. Le
+///				tableau retourné n'est valable que jusqu'au prochain appel ; les lignes obtenues
+///				avec writable non nul sont réécrites quand elles sortent de la mémoire.
+/// @param[in]	img			image lue par jpeg_read_windowed
+/// @param[in]	comp		composante
+/// @param[in]	lin			première ligne de blocs
+/// @param[in]	nbRows		nombre de lignes (au plus img->windowRows)
+/// @param[in]	writable	non nul si les coefficients vont être modifiés
+/// @return		les lignes demandées (result[0] est la ligne lin), NULL en cas d'erreur
+JBLOCKARRAY jpeg_window (JPEGimg *img, int comp, int lin, int nbRows, int writable);
+
+
+/// @brief		Ecrit les coefficients de l'image dans un fichier cache (voir JPEGcacheHeader), à
+///				relire par jpeg_read_cache sans décodage de Huffman. L'image doit être entièrement
+///				décodée ; ses coefficients sont écrits tels quels, donc juste après la lecture pour
+///				garder ceux de la cover.
+/// @param[in]	path	chemin du fichier cache à écrire
+/// @param[in]	cover	chemin de la cover dont img a été lue, dont l'empreinte est gardée dans
+///						l'en-tête pour jpeg_read_cached (NULL : le cache ne se lit que par
+///						jpeg_read_cache)
+/// @param[in]	img		image lue par jpeg_read (ou une autre fonction jpeg_read*, sauf
+///						jpeg_read_windowed)
+/// @return		EXIT_SUCCESS si tout ok, une valeur négative en cas d'erreur
+int jpeg_write_cache (char *path, char *cover, JPEGimg *img);
+
+
+/// @brief		Lit un fichier cache écrit par jpeg_write_cache : le fichier est projeté en mémoire
+///				(en copie privée, il n'est jamais modifié) et l'image pointe directement dans la
+///				projection, sans copie ni décodage. La vue plate est la projection elle-même ;
+///				l'image s'utilise et s'écrit (jpeg_write_from_coeffs) comme une image de jpeg_read.
+/// @param[in]	path	chemin du fichier cache
+/// @return		la structure JPEGimg, NULL en cas d'erreur (fichier absent, tronqué ou d'un
+///				autre format)
+JPEGimg * jpeg_read_cache (char *path);
+
+
+/// @brief		Indique si un chemin désigne un fichier cache (extension JPEG_CACHE_EXT)
+/// @param[in]	path	chemin à tester
+/// @return		non nul pour un fichier cache, 0 sinon
+int jpeg_is_cache (const char *path);
+
+
+/// @brief		Lit le fichier cache d'une cover (même chemin, extension JPEG_CACHE_EXT) par
+///				jpeg_read_cache. Un cache dont l'empreinte (taille, date de modification, hachage
+///				du début et de la fin) n'est pas celle de la cover est ignoré. Un chemin de fichier
+///				cache est lu directement.
+/// @param[in]	path	chemin de l'image cover, ou de son fichier cache
+/// @return		la structure JPEGimg, NULL si la cover n'a pas de cache utilisable (ou si le
+///				fichier cache demandé ne peut pas être lu)
+JPEGimg * jpeg_read_cached (char *path);
+
+
+/// @brief		Lit une cover par son fichier cache (jpeg_read_cached) s'il existe, en la décodant
+///				(jpeg_read) sinon
+/// @param[in]	path	chemin de l'image cover, ou de son fichier cache
+/// @return		la structure JPEGimg, NULL en cas d'erreur
+JPEGimg * jpeg_read_cover (char *path);
+
+
+/// @brief		Mesure la capacité d'une image sans la charger : le flux de Huffman est décodé
+///				MCU par MCU et seuls les coefficients non nuls sont comptés, en mémoire constante.
+///				Une image progressive, dont les coefficients ne sont connus qu'après le dernier
+///				scan, est lue entièrement comme par jpeg_read.
+/// @param[in]	path	chemin de l'image JPEG
+/// @param[out]	cap		capacité de l'image (doit être allouée au préalable)
+/// @return		EXIT_SUCCESS si tout ok, une valeur négative en cas d'erreur
+int jpeg_probe_capacity (char *path, JPEGcapacity *cap);
+
+
+/// @brief Ecrit l'image img dans le fichier outfile (en une seule écriture), avec des
+///		   marqueurs RST tous les img->restartInterval MCU
 /// @param[in] outfile	chemin de l'image JPEG à écrire
 /// @param[in] img		structure contenant les informations de l'image à écrire
 /// @return	EXIT_SUCCESS si tout ok, une valeur négative en cas d'erreur
 int jpeg_write_from_coeffs (char *outfile, JPEGimg *img);
 
 
+/// @brief	Ecrit l'image img en mémoire. Si *buf est NULL ou *size vaut 0, un tampon dimensionné
+///			d'après la taille de l'image lue est alloué avec malloc. Sinon l'image est écrite directement dans *buf ; s'il est trop petit, la
+///			libjpeg le remplace par un tampon alloué avec malloc (*buf change alors de valeur, le
+///			tampon d'origine reste à la charge de l'appelant). Tout tampon alloué ici est à
+///			libérer par l'appelant avec free.
+/// @param[in] img			structure contenant les informations de l'image à écrire
+/// @param[in,out] buf		tampon de sortie
+/// @param[in,out] size		taille de *buf, puis taille de l'image écrite (en octets)
+/// @return	EXIT_SUCCESS si tout ok, une valeur négative en cas d'erreur
+int jpeg_write_mem (JPEGimg *img, unsigned char **buf, unsigned long *size);
+
+
+/// @brief	Retourne une vue plate des coefficients DCT : un tableau contigu de JCOEF aligné sur
+///			FLAT_ALIGN octets, le coefficient de position pos (voir getDCTpos) étant en flat[pos].
+///			La vue est créée au premier appel ; dctCoeffs pointe ensuite dans ce tableau, si bien
+///			que tous les accès restent cohérents. Les modifications ne sont recopiées dans les
+///			tableaux virtuels de la libjpeg que par jpeg_write_from_coeffs (ou jpeg_flat_sync).
+///			Quand la libjpeg a rangé tous les coefficients d'un seul tenant et sans blocs de
+///			remplissage (niveaux de gris, 4:4:4, dimensions multiples de la MCU), la vue est ce
+///			tableau lui-même : ni copie ni recopie.
+/// @param[in] img	pointeur vers la structure contenant l'image JPEG
+/// @return			un pointeur sur le premier coefficient, NULL en cas d'erreur
+JCOEF * jpeg_flat_coeffs (JPEGimg *img);
+
+
+/// @brief	Recopie la vue plate dans les tableaux virtuels de la libjpeg. Si img->optimizeCoding
+///			vaut JPEG_HUFF_STATS ou JPEG_HUFF_OPTIMIZE, les symboles de Huffman de chaque bloc
+///			sont comptés au passage dans img->huffStats.
+/// @param[in] img	pointeur vers la structure contenant l'image JPEG
+/// @return			EXIT_SUCCESS si tout ok, ERR_ARG si l'image n'a pas de vue plate
+int jpeg_flat_sync (JPEGimg *img);
+
+
 /// @brief	En fonction de la valeur pos, retourne une position unique dans l'image JPEG en terme 
 ///			de quadruplet (comp, lin, col, coeff).
 ///			Une position (int) est associée à une unique position (DCTpos) et inversement
@@ -114,6 +517,83 @@ int getDCTpos (JPEGimg*img, int pos, DCTpos * const position);
 /// @return	EXIT_SUCCESS si tout ok, une valeur négative en cas d'erreur.
 int getDCTcoeffValue(JPEGimg* img, DCTpos* pos, int* coeffValue);
 
+
+/// @brief	Retourne un pointeur direct sur le coefficient DCT de position linéaire pos.
+///			Même numérotation que getDCTpos, mais en temps constant et sans branchement
+///			grâce à la table img->addr. Aucune vérification n'est faite sur les arguments.
+/// @param[in] img	pointeur vers la structure contenant l'image JPEG
+/// @param[in] pos	position du coefficient (entre 0 et img->addr.nbCoeffs - 1)
+/// @return			un pointeur sur le coefficient DCT
+static inline JCOEF * getDCTcoeffPtr (JPEGimg *img, int pos)
+{
+	const DCTaddr *addr = &img->addr;
+	unsigned int blk = (unsigned int) pos >> 6;
+	unsigned int lin;
+	int comp = 0, c;
+
+	// Component = number of component starts before blk (unused ones are INT_MAX)
+	for (c = 1; c < MAX_COMPONENTS; c++)
+		comp += (blk >= (unsigned int) addr->compStart[c]);
+	blk -= addr->compStart[comp];
+
+	// Line and column with a multiplication by the reciprocal of the width
+	lin = (unsigned int) ((blk * addr->recip[comp]) >> addr->shift[comp]);
+	return img->dctCoeffs[comp][lin][blk - lin * addr->width[comp]] + (pos & 63);
+}
+
+
+/// @brief	Initialise un itérateur sur les coefficients de l'image
+/// @param[out] it	itérateur à initialiser (doit être alloué au préalable)
+/// @param[in] img	pointeur vers la structure contenant l'image JPEG
+/// @param[in] flags	filtres DCT_ITER_* à appliquer
+/// @return			EXIT_SUCCESS si tout ok, ERR_ARG en cas d'argument invalide
+int DCTiter_init (DCTiter *it, JPEGimg *img, int flags);
+
+
+/// @brief	Passe à la ligne de blocs suivante (usage interne de DCTiter_next et DCTiter_step)
+/// @param[in,out] it	itérateur
+/// @return			1 si une ligne a été trouvée, 0 à la fin de l'image
+int DCTiter_nextRow (DCTiter *it);
+
+
+/// @brief	Avance d'un coefficient sans appliquer les filtres
+/// @param[in,out] it	itérateur
+/// @return			un pointeur sur le coefficient, NULL à la fin de l'image
+static inline JCOEF * DCTiter_step (DCTiter *it)
+{
+	if (it->cur == it->rowEnd && !DCTiter_nextRow (it))
+		return NULL;
+	return it->cur++;
+}
+
+
+/// @brief	Avance jusqu'au prochain coefficient qui passe les filtres de l'itérateur
+/// @param[in,out] it	itérateur
+/// @return			un pointeur sur le coefficient, NULL à la fin de l'image
+static inline JCOEF * DCTiter_next (DCTiter *it)
+{
+	JCOEF *coef;
+
+	while ((coef = DCTiter_step (it)) != NULL)
+	{
+		if ((it->flags & DCT_ITER_SKIP_DC) && ((coef - it->rowStart) & (DCTSIZE2 - 1)) == 0)
+			continue;
+		if ((it->flags & DCT_ITER_SKIP_ZERO) && *coef == 0)
+			continue;
+		break;
+	}
+	return coef;
+}
+
+
+/// @brief	Position linéaire (voir getDCTpos) du dernier coefficient retourné par l'itérateur
+/// @param[in] it	itérateur
+/// @return			la position du coefficient
+static inline int DCTiter_pos (const DCTiter *it)
+{
+	return it->rowPos + (int) (it->cur - it->rowStart) - 1;
+}
+
 /// \}
 
 /// \}
@@ -0,0 +1,406 @@
+/**
+ * \file lsb.c
+ * \brief Noyaux de remplacement / lecture des LSB sur un tableau plat de coefficients DCT.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "lsb.h"
+#include "error.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LSB_X86
+#include <immintrin.h>
+#endif
+
+/* LSB of each 16-bit lane of a 64-bit word */
+#define LANE_LSB 0x0001000100010001ULL
+
+/* Spread a 4-bit nibble over the LSB of 4 consecutive coefficients, first
+ * coefficient (lowest lane on little-endian) taking the highest bit */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SPREAD(n) ((((n) >> 3) & 1ULL) << 48 | (((n) >> 2) & 1ULL) << 32 \
+                  | (((n) >> 1) & 1ULL) << 16 | ((n) & 1ULL))
+#else
+#define SPREAD(n) ((((n) >> 3) & 1ULL) | (((n) >> 2) & 1ULL) << 16 \
+                  | (((n) >> 1) & 1ULL) << 32 | ((n) & 1ULL) << 48)
+#endif
+
+static const uint64_t spread[16] = {
+	SPREAD(0),  SPREAD(1),  SPREAD(2),  SPREAD(3),
+	SPREAD(4),  SPREAD(5),  SPREAD(6),  SPREAD(7),
+	SPREAD(8),  SPREAD(9),  SPREAD(10), SPREAD(11),
+	SPREAD(12), SPREAD(13), SPREAD(14), SPREAD(15)
+};
+
+
+/* Gather the LSB of the 4 coefficients of a word into a nibble, first
+ * coefficient in the highest bit: the products of the multiplier with the
+ * lane bits never collide, so bits 48..51 receive exactly lanes 0..3 */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define GATHER(w) ((unsigned int) ((((w) & LANE_LSB) * 0x0001000200040008ULL) >> 48) & 15)
+#else
+#define GATHER(w) ((unsigned int) ((((w) & LANE_LSB) * 0x0008000400020001ULL) >> 48) & 15)
+#endif
+
+/* Kernels selected by lsb_simd() */
+typedef int (*insert_fn) (JCOEF *coef, const unsigned char *msg, int size);
+typedef void (*extract_fn) (unsigned char *msg, const JCOEF *coef, int size);
+typedef void (*nzmask_fn) (uint64_t *bits, const JCOEF *coef, int nbWords);
+
+static insert_fn insert_kernel = NULL;
+static extract_fn extract_kernel = NULL;
+static nzmask_fn nzmask_kernel = NULL;
+static int simd_level = -1;
+
+
+/* Sum of the four 16-bit lanes of a word */
+static int lane_sum (uint64_t lanes)
+{
+	return (int) ((lanes & 0xFFFF) + ((lanes >> 16) & 0xFFFF)
+	              + ((lanes >> 32) & 0xFFFF) + (lanes >> 48));
+}
+
+
+static int insert_scalar (JCOEF *coef, const unsigned char *msg, int size)
+{
+	uint64_t old[2], bits[2];
+	uint64_t lanes = 0;
+	int changed = 0;
+	int j;
+
+	/* One message byte per group of 8 coefficients, handled as two 64-bit
+	 * words of 4 coefficients each: no branch and no per-bit shift.
+	 * Changes are counted per lane and summed every 16384 bytes, before a
+	 * 16-bit lane can overflow */
+	for (j = 0; j < size; j++, coef += 8)
+	{
+		memcpy (old, coef, sizeof(old));
+		bits[0] = (old[0] & ~LANE_LSB) | spread[msg[j] >> 4];
+		bits[1] = (old[1] & ~LANE_LSB) | spread[msg[j] & 15];
+		memcpy (coef, bits, sizeof(bits));
+		lanes += ((old[0] ^ bits[0]) & LANE_LSB) + ((old[1] ^ bits[1]) & LANE_LSB);
+		if ((j & 16383) == 16383)
+		{
+			changed += lane_sum (lanes);
+			lanes = 0;
+		}
+	}
+
+	return changed + lane_sum (lanes);
+}
+
+
+static void extract_scalar (unsigned char *msg, const JCOEF *coef, int size)
+{
+	uint64_t w[2];
+	int j;
+
+	for (j = 0; j < size; j++, coef += 8)
+	{
+		memcpy (w, coef, sizeof(w));
+		msg[j] = (unsigned char) (GATHER (w[0]) << 4 | GATHER (w[1]));
+	}
+}
+
+
+/* One bit per coefficient, set if it is nonzero: coefficient 64*i+k is bit
+ * k of bits[i] */
+static void nzmask_scalar (uint64_t *bits, const JCOEF *coef, int nbWords)
+{
+	uint64_t w;
+	int i, k;
+
+	for (i = 0; i < nbWords; i++, coef += 64)
+	{
+		for (w = 0, k = 0; k < 64; k++)
+			w |= (uint64_t) (coef[k] != 0) << k;
+		bits[i] = w;
+	}
+}
+
+
+#ifdef LSB_X86
+
+/* Bit selected by each coefficient of a group of 8: coefficient 0 takes the
+ * most significant bit of the message byte */
+#define BIT_SEL_SSE2() _mm_setr_epi16 (128, 64, 32, 16, 8, 4, 2, 1)
+
+/* 8 coefficients <- 1 byte: the byte is broadcast over the 8 lanes, each
+ * lane keeps its own bit, and the comparison turns it into 0 / -1, shifted
+ * down to 0 / 1. Changed LSBs are summed with psadbw, which cannot overflow */
+__attribute__((target("sse2")))
+static __m128i insert8_sse2 (JCOEF *coef, __m128i v)
+{
+	const __m128i sel = BIT_SEL_SSE2 ();
+	const __m128i lsb = _mm_set1_epi16 (1);
+	__m128i old, bits;
+
+	bits = _mm_srli_epi16 (_mm_cmpeq_epi16 (_mm_and_si128 (v, sel), sel), 15);
+	old = _mm_loadu_si128 ((const __m128i*) coef);
+	v = _mm_or_si128 (_mm_andnot_si128 (lsb, old), bits);
+	_mm_storeu_si128 ((__m128i*) coef, v);
+	return _mm_sad_epu8 (_mm_and_si128 (_mm_xor_si128 (old, v), lsb), _mm_setzero_si128 ());
+}
+
+/* 16 coefficients <- 2 bytes */
+__attribute__((target("sse2")))
+static int insert_sse2 (JCOEF *coef, const unsigned char *msg, int size)
+{
+	__m128i count = _mm_setzero_si128 ();
+	int j = 0;
+
+	for (; j + 2 <= size; j += 2, coef += 16)
+	{
+		count = _mm_add_epi64 (count, insert8_sse2 (coef, _mm_set1_epi16 (msg[j])));
+		count = _mm_add_epi64 (count, insert8_sse2 (coef + 8, _mm_set1_epi16 (msg[j + 1])));
+	}
+
+	return _mm_cvtsi128_si32 (count) + _mm_cvtsi128_si32 (_mm_unpackhi_epi64 (count, count))
+	       + insert_scalar (coef, msg + j, size - j);
+}
+
+/* Same with 16 coefficients <- 2 bytes per register: the bytes are
+ * broadcast, then pshufb gives each lane the byte of its group (pshufb does
+ * not cross 128-bit halves, hence one byte per half) */
+__attribute__((target("avx2")))
+static __m256i insert16_avx2 (JCOEF *coef, __m256i v)
+{
+	const __m256i sel = _mm256_broadcastsi128_si256 (BIT_SEL_SSE2 ());
+	const __m256i lsb = _mm256_set1_epi16 (1);
+	__m256i old, bits;
+
+	bits = _mm256_srli_epi16 (_mm256_cmpeq_epi16 (_mm256_and_si256 (v, sel), sel), 15);
+	old = _mm256_loadu_si256 ((const __m256i*) coef);
+	v = _mm256_or_si256 (_mm256_andnot_si256 (lsb, old), bits);
+	_mm256_storeu_si256 ((__m256i*) coef, v);
+	return _mm256_sad_epu8 (_mm256_and_si256 (_mm256_xor_si256 (old, v), lsb), _mm256_setzero_si256 ());
+}
+
+/* 32 coefficients <- 4 bytes */
+__attribute__((target("avx2")))
+static int insert_avx2 (JCOEF *coef, const unsigned char *msg, int size)
+{
+	const __m256i idxLo = _mm256_setr_epi8 (0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	                                        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1);
+	const __m256i idxHi = _mm256_setr_epi8 (2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	                                        3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3);
+	__m256i v, count = _mm256_setzero_si256 ();
+	__m128i sum;
+	uint32_t word;
+	int j = 0;
+
+	for (; j + 4 <= size; j += 4, coef += 32)
+	{
+		memcpy (&word, msg + j, 4);
+		v = _mm256_set1_epi32 ((int) word);
+		count = _mm256_add_epi64 (count, insert16_avx2 (coef, _mm256_shuffle_epi8 (v, idxLo)));
+		count = _mm256_add_epi64 (count, insert16_avx2 (coef + 16, _mm256_shuffle_epi8 (v, idxHi)));
+	}
+
+	sum = _mm_add_epi64 (_mm256_castsi256_si128 (count), _mm256_extracti128_si256 (count, 1));
+	return _mm_cvtsi128_si32 (sum) + _mm_cvtsi128_si32 (_mm_unpackhi_epi64 (sum, sum))
+	       + insert_sse2 (coef, msg + j, size - j);
+}
+
+/* Reverse the order of the eight 16-bit lanes of a register (of each
+ * 128-bit half with AVX2), so that movemask puts coefficient 0 in bit 7 */
+#define REVERSE8_SSE2(x) \
+	_mm_shuffle_epi32 (_mm_shufflehi_epi16 (_mm_shufflelo_epi16 ((x), 0x1B), 0x1B), 0x4E)
+#define REVERSE8_AVX2(x) \
+	_mm256_shuffle_epi32 (_mm256_shufflehi_epi16 (_mm256_shufflelo_epi16 ((x), 0x1B), 0x1B), 0x4E)
+
+/* 16 coefficients -> 2 bytes: LSB moved to the sign bit, packed to bytes
+ * with signed saturation (which keeps the sign), then movemask */
+__attribute__((target("sse2")))
+static void extract_sse2 (unsigned char *msg, const JCOEF *coef, int size)
+{
+	__m128i a, b;
+	int mask, j = 0;
+
+	for (; j + 2 <= size; j += 2, coef += 16)
+	{
+		a = _mm_slli_epi16 (REVERSE8_SSE2 (_mm_loadu_si128 ((const __m128i*) coef)), 15);
+		b = _mm_slli_epi16 (REVERSE8_SSE2 (_mm_loadu_si128 ((const __m128i*) (coef + 8))), 15);
+		mask = _mm_movemask_epi8 (_mm_packs_epi16 (a, b));
+		msg[j] = (unsigned char) mask;
+		msg[j + 1] = (unsigned char) (mask >> 8);
+	}
+	extract_scalar (msg + j, coef, size - j);
+}
+
+/* 32 coefficients -> 4 bytes. packs works on each 128-bit half, so the
+ * 64-bit quarters are put back in message order before the movemask */
+__attribute__((target("avx2")))
+static void extract_avx2 (unsigned char *msg, const JCOEF *coef, int size)
+{
+	__m256i a, b, p;
+	unsigned int mask;
+	int j = 0;
+
+	for (; j + 4 <= size; j += 4, coef += 32)
+	{
+		a = _mm256_slli_epi16 (REVERSE8_AVX2 (_mm256_loadu_si256 ((const __m256i*) coef)), 15);
+		b = _mm256_slli_epi16 (REVERSE8_AVX2 (_mm256_loadu_si256 ((const __m256i*) (coef + 16))), 15);
+		p = _mm256_permute4x64_epi64 (_mm256_packs_epi16 (a, b), 0xD8);
+		mask = (unsigned int) _mm256_movemask_epi8 (p);
+		memcpy (msg + j, &mask, 4);
+	}
+	extract_sse2 (msg + j, coef, size - j);
+}
+
+/* 16 coefficients -> 16 bits: compare with zero, pack the 0 / -1 lanes to
+ * bytes and movemask; the mask of zero coefficients is then inverted */
+__attribute__((target("sse2")))
+static void nzmask_sse2 (uint64_t *bits, const JCOEF *coef, int nbWords)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	__m128i a, b;
+	uint64_t w;
+	int i, k;
+
+	for (i = 0; i < nbWords; i++)
+	{
+		for (w = 0, k = 0; k < 64; k += 16, coef += 16)
+		{
+			a = _mm_cmpeq_epi16 (_mm_loadu_si128 ((const __m128i*) coef), zero);
+			b = _mm_cmpeq_epi16 (_mm_loadu_si128 ((const __m128i*) (coef + 8)), zero);
+			w |= (uint64_t) (unsigned int) _mm_movemask_epi8 (_mm_packs_epi16 (a, b)) << k;
+		}
+		bits[i] = ~w;
+	}
+}
+
+/* 32 coefficients -> 32 bits, quarters reordered after the in-half packs */
+__attribute__((target("avx2")))
+static void nzmask_avx2 (uint64_t *bits, const JCOEF *coef, int nbWords)
+{
+	const __m256i zero = _mm256_setzero_si256 ();
+	__m256i a, b;
+	uint64_t w;
+	int i, k;
+
+	for (i = 0; i < nbWords; i++)
+	{
+		for (w = 0, k = 0; k < 64; k += 32, coef += 32)
+		{
+			a = _mm256_cmpeq_epi16 (_mm256_loadu_si256 ((const __m256i*) coef), zero);
+			b = _mm256_cmpeq_epi16 (_mm256_loadu_si256 ((const __m256i*) (coef + 16)), zero);
+			a = _mm256_permute4x64_epi64 (_mm256_packs_epi16 (a, b), 0xD8);
+			w |= (uint64_t) (unsigned int) _mm256_movemask_epi8 (a) << k;
+		}
+		bits[i] = ~w;
+	}
+}
+
+#endif /* LSB_X86 */
+
+
+int lsb_simd (int level)
+{
+	int best = LSB_SIMD_NONE;
+
+#ifdef LSB_X86
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("sse2"))
+		best = LSB_SIMD_SSE2;
+	if (__builtin_cpu_supports ("avx2"))
+		best = LSB_SIMD_AVX2;
+#endif
+	if (level < 0)
+	{
+		if (simd_level >= 0)
+			return simd_level;
+		level = best;
+	}
+	simd_level = level < best ? level : best;
+
+	switch (simd_level)
+	{
+#ifdef LSB_X86
+		case LSB_SIMD_AVX2:
+			insert_kernel = insert_avx2;
+			extract_kernel = extract_avx2;
+			nzmask_kernel = nzmask_avx2;
+		break;
+
+		case LSB_SIMD_SSE2:
+			insert_kernel = insert_sse2;
+			extract_kernel = extract_sse2;
+			nzmask_kernel = nzmask_sse2;
+		break;
+#endif
+		default:
+			insert_kernel = insert_scalar;
+			extract_kernel = extract_scalar;
+			nzmask_kernel = nzmask_scalar;
+		break;
+	}
+
+	return simd_level;
+}
+
+
+int lsb_insert_bytes (JCOEF *coef, const unsigned char *msg, int size)
+{
+	if (!insert_kernel)
+		lsb_simd (-1);
+	return insert_kernel (coef, msg, size);
+}
+
+
+void lsb_extract_bytes (unsigned char *msg, const JCOEF *coef, int size)
+{
+	if (!extract_kernel)
+		lsb_simd (-1);
+	extract_kernel (msg, coef, size);
+}
+
+
+NZindex * nz_index_build (const JCOEF *coef, int nbCoeffs)
+{
+	NZindex *idx;
+	int i;
+
+	if (!coef || nbCoeffs < 0 || (nbCoeffs & 63))
+	{
+		print_err ("nz_index_build()", "nbCoeffs", ERR_ARG);
+		return NULL;
+	}
+	if ((idx = (NZindex*) calloc (1, sizeof(NZindex))) == NULL)
+	{
+		print_err ("nz_index_build()", "idx", ERR_MEM);
+		return NULL;
+	}
+
+	idx->nbCoeffs = nbCoeffs;
+	idx->nbWords = nbCoeffs >> 6;
+	idx->bits = (uint64_t*) malloc ((idx->nbWords + 1) * sizeof(uint64_t));
+	if (!idx->bits)
+	{
+		print_err ("nz_index_build()", "idx->bits", ERR_MEM);
+		nz_index_free (idx);
+		return NULL;
+	}
+
+	if (!nzmask_kernel)
+		lsb_simd (-1);
+	nzmask_kernel (idx->bits, coef, idx->nbWords);
+
+	for (i = 0; i < idx->nbWords; i++)
+		idx->nbNonZero += __builtin_popcountll (idx->bits[i]);
+
+	return idx;
+}
+
+
+void nz_index_free (NZindex *idx)
+{
+	if (!idx)
+		return;
+	free (idx->bits);
+	free (idx);
+}
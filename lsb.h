@@ -0,0 +1,117 @@
+#ifndef LSB_H_
+#define LSB_H_
+
+/**
+ * \file lsb.h
+ * \brief Noyaux de remplacement / lecture des LSB sur un tableau plat de coefficients DCT.
+ *
+ * Les fonctions travaillent sur des coefficients contigus (voir jpeg_flat_coeffs) :
+ * l'octet j du message occupe les coefficients 8*j à 8*j+7, bit de poids fort en premier.
+ * C'est le format utilisé par basic_insert et basic_extract.
+ * 
+ * \defgroup LSB
+ * \brief Noyaux LSB séquentiels
+ * \{
+ */
+
+#include <stdint.h>
+
+#include "jpeg_manip.h"
+
+/**
+ * \defgroup niveaux
+ * \brief Jeux d'instructions utilisables par les noyaux (voir lsb_simd)
+ * \{
+ */
+/// @brief code C portable
+#define LSB_SIMD_NONE 0
+/// @brief SSE2 (x86)
+#define LSB_SIMD_SSE2 1
+/// @brief AVX2 (x86)
+#define LSB_SIMD_AVX2 2
+/// \}
+
+/// @brief	Index des coefficients non nuls d'un tableau plat : un bit par coefficient, pour
+///			sauter les coefficients nuls un mot de 64 bits à la fois. Créé par nz_index_build.
+typedef struct NZindex_s
+{
+	/// bit (pos & 63) de bits[pos >> 6] à 1 si le coefficient pos est non nul
+	uint64_t * bits;
+	/// nombre de mots de bits
+	int nbWords;
+	/// nombre de coefficients indexés
+	int nbCoeffs;
+	/// nombre de coefficients non nuls
+	int nbNonZero;
+} NZindex;
+
+/// @brief		Remplace les LSB des coefficients coef[0 .. 8*size-1] par les bits du message
+/// @param[in,out] coef	premier coefficient à modifier
+/// @param[in] msg		message à insérer
+/// @param[in] size		taille du message (en octets)
+/// @return				le nombre de coefficients dont la valeur a changé
+int lsb_insert_bytes (JCOEF *coef, const unsigned char *msg, int size);
+
+
+/// @brief		Reconstitue size octets à partir des LSB des coefficients coef[0 .. 8*size-1]
+/// @param[out] msg		tableau recevant le message (doit être alloué au préalable)
+/// @param[in] coef		premier coefficient à lire
+/// @param[in] size		nombre d'octets à extraire
+void lsb_extract_bytes (unsigned char *msg, const JCOEF *coef, int size);
+
+
+/// @brief		Construit l'index des coefficients non nuls en un seul passage sur le tableau
+/// @param[in] coef		tableau plat de coefficients (voir jpeg_flat_coeffs)
+/// @param[in] nbCoeffs	nombre de coefficients (multiple de 64)
+/// @return				l'index alloué, NULL en cas d'erreur
+NZindex * nz_index_build (const JCOEF *coef, int nbCoeffs);
+
+
+/// @brief		Libère un index créé par nz_index_build
+/// @param[in] idx		index à libérer (peut être NULL)
+void nz_index_free (NZindex *idx);
+
+
+/// @brief		Position du premier coefficient non nul à partir de pos (inclus)
+/// @param[in] idx		index
+/// @param[in] pos		position de départ
+/// @return				la position trouvée, -1 s'il n'y en a plus
+static inline int nz_next (const NZindex *idx, int pos)
+{
+	uint64_t w;
+	int i = pos >> 6;
+
+	if (pos >= idx->nbCoeffs)
+		return -1;
+	for (w = idx->bits[i] & (~0ULL << (pos & 63)); !w; w = idx->bits[i])
+		if (++i == idx->nbWords)
+			return -1;
+	return (i << 6) + __builtin_ctzll (w);
+}
+
+
+/// @brief		Retire de l'index un coefficient devenu nul (par exemple un 1 dont le LSB a été
+///				mis à 0) : son bit est effacé et le compte mis à jour.
+/// @param[in,out] idx	index
+/// @param[in] pos		position du coefficient
+static inline void nz_clear (NZindex *idx, int pos)
+{
+	uint64_t bit = 1ULL << (pos & 63);
+
+	if (idx->bits[pos >> 6] & bit)
+	{
+		idx->bits[pos >> 6] &= ~bit;
+		idx->nbNonZero--;
+	}
+}
+
+
+/// @brief		Limite le jeu d'instructions utilisé par les noyaux. Par défaut, le meilleur
+///				jeu supporté par le processeur est choisi au premier appel d'un noyau.
+/// @param[in] level	niveau maximal LSB_SIMD_* (ou -1 pour seulement consulter le niveau)
+/// @return				le niveau effectivement utilisé
+int lsb_simd (int level);
+
+/// \}
+
+#endif /* LSB_H_ */
@@ -1,9 +1,13 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include <time.h>
 
 #include "error.h"
 #include "jpeg_manip.h"
+#include "lsb.h"
+#include "batch.h"
 #include "TODO.h"
 
 
@@ -23,13 +27,8 @@ void modifDCTcoeff(JPEGimg* img, DCTpos* pos, int modif)
 /// @return le nombre de coefficients DCT présents dans l'image
 int nb_DCT_coeffs(JPEGimg* img)
 {
-    int nb_coeff_in_image=0, i=0;
-    for (i = 0; i<img->cinfo->num_components; i++){
-        int nb_block_in_composant= img->cinfo->comp_info[i].height_in_blocks*img->cinfo->comp_info[i].width_in_blocks;
-        int nb_coef_in_block = nb_block_in_composant*64;
-        nb_coeff_in_image+=nb_coef_in_block;
-    }
-    return nb_coeff_in_image;
+    // calculé une fois pour toutes par jpeg_read
+    return img->addr.nbCoeffs;
 }
 
 /// @brief Lecture du fichier path, récupération de la taille dans size et retour du contenu
@@ -89,35 +88,25 @@ int bit_insert(JPEGimg* img, DCTpos* pos, int bit)
 ///         EXIT_FAILURE si la taille du message est trop grande
 int basic_insert(byte* msg, int size, JPEGimg* img)
 {
-    DCTpos pos = { 0 };
-    int countBits = 0;
+    JCOEF* coef;
+    byte header[4];
 
-    // insertion de la taille du message: 4 octets => 8*4 = 32 bits
-    for (int i = 0; i < 32; i++) {
-        getDCTpos(img, countBits, &pos);
-        byte b = (size >> 31 - i) & 1;
-        bit_insert(img, &pos, b);
-        countBits += 1;
-    }
+    // une seule vérification de capacité: 32 bits de taille + 8 bits par octet
+    if (size < 0 || (long long)size * 8 + 32 > nb_DCT_coeffs(img))
+        return ERR_TREAT;
+    if ((coef = jpeg_flat_coeffs(img)) == NULL)
+        return ERR_MEM;
 
-    if (((size * 8) + 32) <= nb_DCT_coeffs(img)) {
-        // insertion du message
-        for (int j = 0; j < size; j++) {
-            // parcourir bit par bit msg[j] => k
-            if (countBits == nb_DCT_coeffs(img)) {
-                return EXIT_FAILURE;
-            }
-            for (int k = 0; k < 8; k++)
-            {
-                getDCTpos(img, countBits, &pos);
-                byte b = (msg[j] >> 7 - k) & 1;
-                bit_insert(img, &pos, b);
-                countBits += 1;
-            }
-        }
-        return EXIT_SUCCESS;
-    }
-    return ERR_TREAT;
+    // insertion de la taille du message: 4 octets => 8*4 = 32 bits, poids fort en premier
+    header[0] = (byte)(size >> 24);
+    header[1] = (byte)(size >> 16);
+    header[2] = (byte)(size >> 8);
+    header[3] = (byte)size;
+    lsb_insert_bytes(coef, header, 4);
+
+    // insertion du message, octet par octet directement dans les coefficients
+    lsb_insert_bytes(coef + 32, msg, size);
+    return EXIT_SUCCESS;
 }
 
 /// @brief Extraction d'un message d'une image JPEG
@@ -129,120 +118,198 @@ int basic_insert(byte* msg, int size, JPEGimg* img)
 ///         NULL si la taille du message est trop grande
 byte* basic_extract(JPEGimg* img, int* size)
 {
-    int i = 0;
-    int coeff = 0;
-    int result = 0;
-    int countBits = 0;
-    char* msg;
-    char c = ' ';
-    DCTpos pos = { 0 };
+    JCOEF* coef;
+    byte header[4];
+    byte* msg;
 
-    // récupération de la taille du message
-    for (; i < 32; i++) {
-        getDCTpos(img, countBits, &pos);
-        getDCTcoeffValue(img, &pos, &coeff);
-        byte b = coeff & 1; // LSB
-        countBits += 1;
-        int clearBit = ~(1 << 31 - i);
-        int mask = result & clearBit;
-        result = mask | (b << 31 - i);
+    if ((coef = jpeg_flat_coeffs(img)) == NULL)
+        return NULL;
+
+    // récupération de la taille du message: 4 octets => 8*4 = 32 bits, poids fort en premier
+    lsb_extract_bytes(header, coef, 4);
+    *size = (int)((unsigned int)header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3]);
+
+    if (*size < 0 || (long long)*size * 8 + 32 >= nb_DCT_coeffs(img))
+        return NULL;
+    if ((msg = (byte*)malloc(sizeof(char) * (*size + 1))) == NULL) {
+        print_err("basic_extract()", "msg", ERR_MEM);
+        return NULL;
     }
 
-    *size = result;
-    msg = malloc(sizeof(char) * *size);
+    // lecture du message, 8 coefficients par octet
+    lsb_extract_bytes(msg, coef + 32, *size);
     msg[*size] = '\0';
-    if (*size * 8 + 32 < nb_DCT_coeffs(img)) {
-        // lecture du message
-        for (int j = 0; j < *size; j++) {
-            // parcourir bit par bit msg[i] => k
-            for (int k = 0; k < 8; k++)
-            {
-                getDCTpos(img, countBits, &pos);
-                getDCTcoeffValue(img, &pos, &coeff);
-                byte b = coeff & 1; // LSB
-                countBits += 1;
-                int clearBit = ~(1 << 7 - k);
-                int mask = c & clearBit;
-                c = mask | (b << 7 - k);
+    return msg;
+}
+
+/// @brief Lit les LSB de size octets à partir du coefficient pos (multiple de 8), ligne de blocs
+///        par ligne de blocs: les lignes d'une image partiellement décodée ne se suivent pas
+///        forcément en mémoire
+/// @param[in] img     image (éventuellement partiellement décodée)
+/// @param[in] pos     position (voir getDCTpos) du premier coefficient à lire
+/// @param[out] msg    tableau recevant les octets (doit être alloué au préalable)
+/// @param[in] size    nombre d'octets à lire
+static void extract_rows(JPEGimg* img, int pos, byte* msg, int size)
+{
+    DCTpos p;
+    int n;
+
+    while (size > 0) {
+        getDCTpos(img, pos, &p);
+        // octets restant sur la ligne: 8 coefficients par octet, 64 par bloc
+        n = ((img->addr.width[p.comp] - p.col) * DCTSIZE2 - p.coeff) / 8;
+        if (n > size)
+            n = size;
+        lsb_extract_bytes(msg, &img->dctCoeffs[p.comp][p.lin][p.col][p.coeff], n);
+        msg += n;
+        size -= n;
+        pos += 8 * n;
+    }
+}
+
+/// @brief Extraction d'un message (inséré par basic_insert) directement depuis un fichier JPEG,
+///        en ne décodant l'image que jusqu'au dernier coefficient du message: un message court
+///        dans une grande image ne coûte que le décodage de ses premières lignes de MCU
+/// @param[in] path     chemin de l'image JPEG
+/// @param[out] size    pointeur sur la taille du message extrait
+/// @return un pointeur sur les données extraites
+///         NULL si l'image ne peut pas être lue ou si la taille du message est trop grande
+byte* basic_extract_file(char* path, int* size)
+{
+    JPEGimg* img;
+    byte header[4];
+    byte* msg = NULL;
+
+    if ((img = jpeg_read_partial(path)) == NULL)
+        return NULL;
+
+    // les 32 bits de la taille, puis seulement les coefficients du message
+    if (jpeg_decode_until(img, 32) == EXIT_SUCCESS && img->addr.nbCoeffs >= 32) {
+        extract_rows(img, 0, header, 4);
+        *size = (int)((unsigned int)header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3]);
+
+        if (*size >= 0 && (long long)*size * 8 + 32 < nb_DCT_coeffs(img)
+            && jpeg_decode_until(img, 32 + 8 * *size) == EXIT_SUCCESS) {
+            if ((msg = (byte*)malloc(sizeof(char) * (*size + 1))) == NULL)
+                print_err("basic_extract_file()", "msg", ERR_MEM);
+            else {
+                extract_rows(img, 32, msg, *size);
+                msg[*size] = '\0';
             }
-            msg[j] = c;
         }
-        return msg;
-    } else return NULL;
+    }
+
+    free_jpeg_img(img);
+    return msg;
 }
 
-/// @brief Insertion d'un message dans une image JPEG avec ré-insertion si zéro
-///        Si le message est trop grand pour l'image, retourner la valeur ERR_TREAT
+/// @brief Insertion d'un message (même format que basic_insert) dans une image lue par
+///        jpeg_read_windowed: les lignes de blocs sont parcourues par fenêtres de
+///        img->windowRows lignes, seule la fenêtre courante étant en mémoire
 /// @param[in] msg        pointeur vers le message (tableau de unsigned char)
 /// @param[in] size        taille du message (en octets)
-/// @param[in,out] img    pointeur sur l'image cover
+/// @param[in,out] img    pointeur sur l'image cover, lue par jpeg_read_windowed
 /// @return EXIT_SUCCESS ou une valeur négative en cas d'erreur
-///         EXIT_FAILURE si la taille du message est trop grande
-int advanced_insert(byte* msg, int size, JPEGimg* img)
+int basic_insert_windowed(byte* msg, int size, JPEGimg* img)
 {
-    DCTpos pos = { 0 };
-    int countBits = 0;
-    int bitBefore = 0;
-    int coeff = 0;
+    JBLOCKARRAY rows;
+    byte header[4];
+    const byte* src = header;
+    int left = 4, inHeader = 1;
+    int comp, lin, r, nbRows, height, rowBytes, off, n;
 
-    // insertion de la taille du message: 4 octets => 8*4 = 32 bits
-    for (int i = 0; i < 32; i++) {
-        getDCTpos(img, countBits, &pos);
-        getDCTcoeffValue(img, &pos, &coeff);
-        if (coeff != 0) {
-            getDCTpos(img, countBits, &pos);
-            byte b = (size >> 31 - i) & 1;
-            bit_insert(img, &pos, b);
-            getDCTcoeffValue(img, &pos, &coeff);
-            while (coeff == 0) {
-                countBits += 1;
-                getDCTpos(img, countBits, &pos);
-                bit_insert(img, &pos, b);
-                getDCTcoeffValue(img, &pos, &coeff);
-            }
-            countBits += 1;
-        }
-        else {
-            i--;
-            countBits += 1;
-        }
-    }
+    if (size < 0 || (long long)size * 8 + 32 > nb_DCT_coeffs(img))
+        return ERR_TREAT;
 
-    if (((size * 8) + 32) <= nb_DCT_coeffs(img)) {
-        // insertion du message
-        for (int j = 0; j < size; j++) {
-            // parcourir bit par bit msg[j] => k
-            if (countBits == nb_DCT_coeffs(img)) {
-                return EXIT_FAILURE;
-            }
-            for (int k = 0; k < 8; k++)
-            {
-                getDCTpos(img, countBits, &pos);
-                getDCTcoeffValue(img, &pos, &coeff);
-                if (coeff != 0) {
-                    getDCTpos(img, countBits, &pos);
-                    byte b = (msg[j] >> 7 - k) & 1;
-                    bit_insert(img, &pos, b);
-                    getDCTcoeffValue(img, &pos, &coeff);
-                    while (coeff == 0) {
-                        countBits += 1;
-                        getDCTpos(img, countBits, &pos);
-                        bit_insert(img, &pos, b);
-                        getDCTcoeffValue(img, &pos, &coeff);
+    // la taille du message sur 4 octets, poids fort en premier, puis le message
+    header[0] = (byte)(size >> 24);
+    header[1] = (byte)(size >> 16);
+    header[2] = (byte)(size >> 8);
+    header[3] = (byte)size;
+
+    for (comp = 0; comp < img->cinfo->num_components && left > 0; comp++) {
+        height = img->cinfo->comp_info[comp].height_in_blocks;
+        // 64 coefficients par bloc, 8 par octet: une ligne de blocs porte un nombre entier d'octets
+        rowBytes = img->addr.width[comp] * DCTSIZE2 / 8;
+        for (lin = 0; lin < height && left > 0; lin += nbRows) {
+            nbRows = height - lin < img->windowRows ? height - lin : img->windowRows;
+            if ((rows = jpeg_window(img, comp, lin, nbRows, 1)) == NULL)
+                return ERR_MEM;
+            for (r = 0; r < nbRows && left > 0; r++) {
+                for (off = 0; off < rowBytes && left > 0; off += n) {
+                    n = rowBytes - off < left ? rowBytes - off : left;
+                    lsb_insert_bytes(rows[r][0] + 8 * off, src, n);
+                    src += n;
+                    left -= n;
+                    if (left == 0 && inHeader) {
+                        inHeader = 0;
+                        src = msg;
+                        left = size;
                     }
-                    countBits += 1;
-                }
-                else {
-                    k--;
-                    countBits += 1;
                 }
             }
         }
-        return EXIT_SUCCESS;
+    }
+    return EXIT_SUCCESS;
+}
+
+/// @brief Insère un bit dans le premier coefficient non nul à partir de *pos
+///        Un coefficient devenu nul est retiré de l'index et le bit est ré-inséré plus loin
+/// @param[in,out] coef   tableau plat de coefficients
+/// @param[in,out] idx    index des coefficients non nuls de coef
+/// @param[in,out] pos    position de départ, puis position suivant le coefficient utilisé
+/// @param[in] b          bit à insérer
+/// @return EXIT_SUCCESS, ERR_TREAT s'il ne reste plus de coefficient utilisable
+static int nz_bit_insert(JCOEF* coef, NZindex* idx, int* pos, int b)
+{
+    int p = *pos;
+
+    while ((p = nz_next(idx, p)) >= 0) {
+        coef[p] = (coef[p] & ~1) | b;
+        if (coef[p] != 0) {
+            *pos = p + 1;
+            return EXIT_SUCCESS;
+        }
+        // le coeff est devenu nul: ré-insertion dans les suivants
+        nz_clear(idx, p++);
     }
     return ERR_TREAT;
 }
 
+/// @brief Insertion d'un message dans une image JPEG avec ré-insertion si zéro
+///        Si le message est trop grand pour l'image, retourner la valeur ERR_TREAT
+/// @param[in] msg        pointeur vers le message (tableau de unsigned char)
+/// @param[in] size        taille du message (en octets)
+/// @param[in,out] img    pointeur sur l'image cover
+/// @return EXIT_SUCCESS ou une valeur négative en cas d'erreur
+///         ERR_TREAT si la taille du message est trop grande
+int advanced_insert(byte* msg, int size, JPEGimg* img)
+{
+    JCOEF* coef;
+    NZindex* idx;
+    int pos = 0, ret = EXIT_SUCCESS;
+
+    if (size < 0)
+        return ERR_TREAT;
+    if ((coef = jpeg_flat_coeffs(img)) == NULL || (idx = nz_index_build(coef, nb_DCT_coeffs(img))) == NULL)
+        return ERR_MEM;
+
+    // il faut au moins un coefficient non nul par bit inséré
+    if ((long long)size * 8 + 32 > idx->nbNonZero)
+        ret = ERR_TREAT;
+
+    // insertion de la taille du message: 4 octets => 8*4 = 32 bits
+    for (int i = 0; i < 32 && ret == EXIT_SUCCESS; i++)
+        ret = nz_bit_insert(coef, idx, &pos, (size >> 31 - i) & 1);
+
+    // insertion du message, bit de poids fort en premier
+    for (int i = 0; i < size * 8 && ret == EXIT_SUCCESS; i++)
+        ret = nz_bit_insert(coef, idx, &pos, (msg[i >> 3] >> 7 - (i & 7)) & 1);
+
+    nz_index_free(idx);
+    return ret;
+}
+
 /// @brief Extraction d'un message d'une image JPEG
 ///        L'extraction doit permettre de récupérer le message précédement inséré avec
 ///        la fonction advanced_insert
@@ -252,61 +319,222 @@ int advanced_insert(byte* msg, int size, JPEGimg* img)
 ///         null si la taille du message est trop grande
 byte* advanced_extract(JPEGimg* img, int* size)
 {
-    int i = 0;
-    int coeff = 0;
-    int result = 0;
-    int countBits = 0;
-    char* msg;
-    char c = ' ';
-    DCTpos pos = { 0 };
+    JCOEF* coef;
+    NZindex* idx;
+    byte* msg = NULL;
+    unsigned int result = 0;
+    int pos = 0;
 
-    // récupération de la taille du message
-    for (; i < 32; i++) {
-        getDCTpos(img, countBits, &pos);
-        getDCTcoeffValue(img, &pos, &coeff);
-        if (coeff == 0) {
-            i--;
-        }
-        else {
-            byte b = coeff & 1; // LSB
-            int clearBit = ~(1 << 31 - i);
-            int mask = result & clearBit;
-            result = mask | (b << 31 - i);
+    if ((coef = jpeg_flat_coeffs(img)) == NULL || (idx = nz_index_build(coef, nb_DCT_coeffs(img))) == NULL)
+        return NULL;
+
+    // récupération de la taille du message dans les 32 premiers coefficients non nuls
+    if (idx->nbNonZero >= 32) {
+        for (int i = 0; i < 32; i++, pos++) {
+            pos = nz_next(idx, pos);
+            result = (result << 1) | (coef[pos] & 1);
         }
-        countBits += 1;
-    }
+        *size = (int)result;
 
-    *size = result;
-    msg = malloc(sizeof(char) * *size);
-    //msg[*size] = '\0';
-    if (*size * 8 + countBits < nb_DCT_coeffs(img)) {
-        // lecture du message
-        for (int j = 0; j < *size; j++) {
-            // parcourir bit par bit msg[i] => k
-            for (int k = 0; k < 8; k++)
-            {
-                getDCTpos(img, countBits, &pos);
-                getDCTcoeffValue(img, &pos, &coeff);
-                if (coeff == 0) {
-                    k--;
+        if (*size >= 0 && (long long)*size * 8 <= idx->nbNonZero - 32
+            && (msg = (byte*)malloc(sizeof(char) * (*size + 1))) != NULL) {
+            // lecture du message
+            for (int j = 0; j < *size; j++) {
+                byte c = 0;
+                for (int k = 0; k < 8; k++, pos++) {
+                    pos = nz_next(idx, pos);
+                    c = (c << 1) | (coef[pos] & 1);
                 }
-                else {
-                    byte b = coeff & 1; // LSB
-                    int clearBit = ~(1 << 7 - k);
-                    int mask = c & clearBit;
-                    c = mask | (b << 7 - k);
-                }
-                countBits += 1;
+                msg[j] = c;
             }
-            msg[j] = c;
+            msg[*size] = '\0';
         }
-        return msg;
     }
-    else return NULL;
+
+    nz_index_free(idx);
+    return msg;
+}
+
+/// @brief Mesure le débit de basic_insert et basic_extract sur une image, comparé à une copie
+///        mémoire du même volume (borne imposée par la bande passante), à l'accès bit à bit par
+///        getDCTpos et aux noyaux sans SIMD
+/// @param[in] path    chemin de l'image cover
+/// @param[in] runs    nombre de répétitions de chaque mesure
+/// @return EXIT_SUCCESS ou EXIT_FAILURE
+int bench_lsb(char* path, int runs)
+{
+    JPEGimg* img;
+    JCOEF* flat;
+    JCOEF* copy;
+    DCTpos pos = { 0 };
+    byte* msg;
+    int size, extracted, nbCoeffs, coeff, level;
+    double mb, tCopy, tInsert, tInsertScalar, tBit, tExtract, tScalar, tBitExtract, tAdvInsert, tAdvExtract;
+    clock_t start;
+
+    if ((img = jpeg_read(path)) == NULL)
+        return EXIT_FAILURE;
+    nbCoeffs = nb_DCT_coeffs(img);
+    size = (nbCoeffs - 40) / 8;
+    flat = jpeg_flat_coeffs(img);
+    msg = (byte*)malloc(size);
+    copy = (JCOEF*)malloc(nbCoeffs * sizeof(JCOEF));
+    if (!flat || !msg || !copy) {
+        print_err("bench_lsb()", "msg", ERR_MEM);
+        free(msg);
+        free(copy);
+        free_jpeg_img(img);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < size; i++)
+        msg[i] = (byte)rand();
+    mb = (double)nbCoeffs * sizeof(JCOEF) / (1024. * 1024.);
+
+    // référence: lecture + écriture de tout le tableau de coefficients
+    start = clock();
+    for (int r = 0; r < runs; r++) {
+        memcpy(copy, flat, nbCoeffs * sizeof(JCOEF));
+        flat[r % nbCoeffs] ^= copy[0] & 1;
+    }
+    tCopy = (double)(clock() - start) / CLOCKS_PER_SEC / runs;
+
+    start = clock();
+    for (int r = 0; r < runs; r++)
+        basic_insert(msg, size, img);
+    tInsert = (double)(clock() - start) / CLOCKS_PER_SEC / runs;
+
+    // ancien chemin: une recherche de position et un appel par bit
+    start = clock();
+    for (int i = 0; i < size * 8; i++) {
+        getDCTpos(img, 32 + i, &pos);
+        bit_insert(img, &pos, (msg[i >> 3] >> (7 - (i & 7))) & 1);
+    }
+    tBit = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for (int r = 0; r < runs; r++)
+        free(basic_extract(img, &extracted));
+    tExtract = (double)(clock() - start) / CLOCKS_PER_SEC / runs;
+
+    level = lsb_simd(LSB_SIMD_NONE);
+    start = clock();
+    for (int r = 0; r < runs; r++)
+        basic_insert(msg, size, img);
+    tInsertScalar = (double)(clock() - start) / CLOCKS_PER_SEC / runs;
+
+    start = clock();
+    for (int r = 0; r < runs; r++)
+        free(basic_extract(img, &extracted));
+    tScalar = (double)(clock() - start) / CLOCKS_PER_SEC / runs;
+    level = lsb_simd(LSB_SIMD_AVX2);
+
+    start = clock();
+    for (int i = 0; i < size * 8; i++) {
+        getDCTpos(img, 32 + i, &pos);
+        getDCTcoeffValue(img, &pos, &coeff);
+        copy[i >> 3] = (copy[i >> 3] << 1) | (coeff & 1);
+    }
+    tBitExtract = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    // sauts des coefficients nuls: message 8 fois plus court
+    start = clock();
+    for (int r = 0; r < runs; r++)
+        advanced_insert(msg, size / 8, img);
+    tAdvInsert = (double)(clock() - start) / CLOCKS_PER_SEC / runs;
+
+    start = clock();
+    for (int r = 0; r < runs; r++)
+        free(advanced_extract(img, &extracted));
+    tAdvExtract = (double)(clock() - start) / CLOCKS_PER_SEC / runs;
+
+    printf("%d coefficients (%.1f MB), message of %d bytes, SIMD level %d\n", nbCoeffs, mb, size, level);
+    printf("   memcpy                  %8.3f ms  %8.1f MB/s\n", tCopy * 1e3, mb / tCopy);
+    printf("   basic_insert            %8.3f ms  %8.1f MB/s\n", tInsert * 1e3, mb / tInsert);
+    printf("   basic_insert (scalar)   %8.3f ms  %8.1f MB/s\n", tInsertScalar * 1e3, mb / tInsertScalar);
+    printf("   bit by bit insert       %8.3f ms  %8.1f MB/s\n", tBit * 1e3, mb / tBit);
+    printf("   basic_extract           %8.3f ms  %8.1f MB/s\n", tExtract * 1e3, mb / tExtract);
+    printf("   basic_extract (scalar)  %8.3f ms  %8.1f MB/s\n", tScalar * 1e3, mb / tScalar);
+    printf("   bit by bit extract      %8.3f ms  %8.1f MB/s\n", tBitExtract * 1e3, mb / tBitExtract);
+    printf("   advanced_insert (1/8)   %8.3f ms\n", tAdvInsert * 1e3);
+    printf("   advanced_extract (1/8)  %8.3f ms\n", tAdvExtract * 1e3);
+
+    free(msg);
+    free(copy);
+    free_jpeg_img(img);
+    return EXIT_SUCCESS;
+}
+
+/// @brief Insertion (basic_insert) de chaque message du manifeste dans sa cover, en parallèle
+/// @param[in] manifest   chemin du manifeste, une ligne "cover message sortie" par image
+/// @param[in] pipeline   0 : images réparties entre threads (batch_run)
+///                       1 : pipeline lecture / insertion / écriture (batch_pipeline)
+/// @param[in] param      nombre de threads pour batch_run, profondeur des files pour batch_pipeline
+///                       (0 : valeur par défaut)
+/// @return EXIT_SUCCESS si toutes les images ont été écrites, EXIT_FAILURE sinon
+int batch_main(char* manifest, int pipeline, int param)
+{
+    Batch* batch;
+    struct timespec start, end;
+    double elapsed;
+    int failed;
+
+    if ((batch = batch_load(manifest)) == NULL)
+        return EXIT_FAILURE;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pipeline)
+        failed = batch_pipeline(batch, param, basic_insert);
+    else
+        failed = batch_run(batch, param, basic_insert);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+    for (int i = 0; i < batch->nbJobs && failed > 0; i++)
+        if (batch->jobs[i].status != EXIT_SUCCESS)
+            printf("Failed (%d): %s -> %s\n", batch->jobs[i].status, batch->jobs[i].cover, batch->jobs[i].output);
+    printf("%d images, %d failed, %.3f s (%.1f images/s)\n", batch->nbJobs, failed, elapsed,
+           elapsed > 0 ? batch->nbJobs / elapsed : 0.);
+
+    batch_free(batch);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/// @brief Ecrit le fichier cache des coefficients d'une cover, pour que les insertions suivantes
+///        la relisent avec jpeg_read_cache sans décodage de Huffman. Ecrit sous le nom de la
+///        cover avec l'extension .jcc, il est utilisé à la place de la cover (jpeg_read_cover)
+/// @param[in] cover      chemin de l'image cover
+/// @param[in] cache      chemin du fichier cache à écrire
+/// @return EXIT_SUCCESS si le cache a été écrit, EXIT_FAILURE sinon
+int cache_main(char* cover, char* cache)
+{
+    JPEGimg* img;
+    int ret;
+
+    if ((img = jpeg_read(cover)) == NULL)
+        return EXIT_FAILURE;
+    ret = jpeg_write_cache(cache, cover, img);
+    free_jpeg_img(img);
+    if (ret != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    printf("Cache of %s written in %s\n", cover, cache);
+    return EXIT_SUCCESS;
 }
 
 /// @}
 
+/// @brief Affiche les différentes façons d'appeler le programme
+/// @param[in] prog nom du programme (argv[0])
+static void print_usage(char* prog)
+{
+    printf("Usage: %s <cover.jpg|cover.jcc> <copy.jpg> [restart interval]\n", prog);
+    printf("       %s -bench <cover.jpg> [runs]\n", prog);
+    printf("       %s -batch <manifest> [threads]\n", prog);
+    printf("       %s -pipeline <manifest> [depth]\n", prog);
+    printf("       %s -cache <cover.jpg> <cover.jcc>\n", prog);
+    printf("The restart interval is a number of MCU between 0 and 65535 (0: no RST markers)\n");
+    printf("The number of runs is at least 1 (default: 20)\n");
+}
+
 /// @brief Point d'entrée du programme
 /// @param[in] argc nombre d'arguments de la ligne de commande
 /// @param[in] argv arguments de la ligne de commande
@@ -314,6 +542,9 @@ byte* advanced_extract(JPEGimg* img, int* size)
 int main(int argc, char** argv)
 {
 	int return_value;
+	long restart_interval = 0;
+	long runs = 20;
+	char* end;
 	JPEGimg* img = NULL;
 	DCTpos pos = { 0 };
 
@@ -322,12 +553,51 @@ int main(int argc, char** argv)
 	{
 		printf("%s: Reads a jpeg image and write it in a new file\n", argv[0]);
 		printf("Not enough arguments for %s\n", argv[0]);
-		printf("Usage: %s <cover.jpg> <copy.jpg>\n", argv[0]);
+		print_usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	// Lecture de l'image
-	img = jpeg_read(argv[1]);
+	// Mesure de débit de l'insertion et de l'extraction
+	if (strcmp(argv[1], "-bench") == 0)
+	{
+		// Chaque durée est divisée par le nombre de passes
+		if (argc > 3)
+		{
+			runs = strtol(argv[3], &end, 10);
+			if (end == argv[3] || *end != '\0' || runs < 1 || runs > INT_MAX)
+			{
+				printf("Invalid number of runs: %s\n", argv[3]);
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+		return bench_lsb(argv[2], (int) runs);
+	}
+
+	// Insertion en lot: une tâche par ligne du manifeste, en parallèle ou en pipeline
+	if (strcmp(argv[1], "-batch") == 0)
+		return batch_main(argv[2], 0, argc > 3 ? atoi(argv[3]) : 0);
+	if (strcmp(argv[1], "-pipeline") == 0)
+		return batch_main(argv[2], 1, argc > 3 ? atoi(argv[3]) : 0);
+
+	// Coefficients décodés d'une cover, relus ensuite sans décodage de Huffman (jpeg_read_cache)
+	if (strcmp(argv[1], "-cache") == 0 && argc > 3)
+		return cache_main(argv[2], argv[3]);
+
+	// Intervalle de restart, vérifié avant la lecture: le marqueur DRI le code sur 2 octets
+	if (argc > 3)
+	{
+		restart_interval = strtol(argv[3], &end, 10);
+		if (end == argv[3] || *end != '\0' || restart_interval < 0 || restart_interval > 65535)
+		{
+			printf("Invalid restart interval: %s\n", argv[3]);
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Lecture de l'image, par son fichier cache s'il existe
+	img = jpeg_read_cover(argv[1]);
 	if (!img)
 		return EXIT_FAILURE;
 
@@ -342,7 +612,8 @@ int main(int argc, char** argv)
     ex: advanced_insert(...)
     */
 
-	// Ecriture dans un nouveau fichier
+	// Ecriture dans un nouveau fichier, avec des marqueurs RST si demandé (encodage parallèle)
+	img->restartInterval = (unsigned int) restart_interval;
 	return_value = jpeg_write_from_coeffs(argv[2], img);
 	if (return_value == EXIT_SUCCESS)
 		printf("\nImage written in %s\n", argv[2]);